@@ -1,5 +1,5 @@
 /*
- * clock.c - Routines for using the cycle counters on x86,
+ * clock.c - Routines for using the cycle counters on x86, x86-64,
  *           Alpha, and Sparc boxes.
  *
  * Copyright (c) 2002, R. Bryant and D. O'Hallaron, All rights reserved.
@@ -9,9 +9,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <time.h>
 #include <sys/times.h>
 #include "clock.h"
 
+#if defined(__x86_64__)
+#include <cpuid.h>
+#endif
+
 
 /*******************************************************
  * Machine dependent functions
@@ -136,27 +141,69 @@ double get_counter()
 #else
 
 /****************************************************************
- * All the other platforms for which we haven't implemented cycle
- * counter routines. Newer models of sparcs (v8plus) have cycle
- * counters that can be accessed from user programs, but since there
- * are still many sparc boxes out there that don't support this, we
- * haven't provided a Sparc version here.
+ * All the other platforms, x86-64 among them. On x86-64 with an
+ * invariant TSC, which ticks at a constant rate whatever the power
+ * state of the core, we read it with RDTSCP, which waits for the
+ * instructions before it to finish. Everywhere else, and on x86-64
+ * without one, the "cycles" are the ns of CLOCK_MONOTONIC_RAW, which
+ * NTP does not slew.
  ***************************************************************/
 
+static unsigned long long cyc_start = 0;
+static int use_tsc = -1;  /* read the TSC? decided on first use */
+
+/* Read CLOCK_MONOTONIC_RAW in ns */
+static unsigned long long clock_ns(void)
+{
+    struct timespec ts;
+
+#ifdef CLOCK_MONOTONIC_RAW
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#if defined(__x86_64__)
+/* Does the processor have RDTSCP and an invariant TSC? */
+static int tsc_usable(void)
+{
+    unsigned eax, ebx, ecx, edx;
+
+    if (__get_cpuid_max(0x80000000, NULL) < 0x80000007)
+        return 0;
+    __cpuid(0x80000001, eax, ebx, ecx, edx);
+    if (!(edx & (1u << 27)))    /* RDTSCP */
+        return 0;
+    __cpuid(0x80000007, eax, ebx, ecx, edx);
+    return (edx & (1u << 8)) != 0;  /* invariant TSC */
+}
+
+static inline unsigned long long read_counter(void)
+{
+    unsigned hi, lo, aux;
+
+    if (!use_tsc)
+        return clock_ns();
+    asm volatile("rdtscp" : "=a" (lo), "=d" (hi), "=c" (aux));
+    return (unsigned long long)hi << 32 | lo;
+}
+#else
+#define tsc_usable() 0
+#define read_counter() clock_ns()
+#endif
+
 void start_counter()
 {
-    printf("ERROR: You are trying to use a start_counter routine in clock.c\n");
-    printf("that has not been implemented yet on this platform.\n");
-    printf("Please choose another timing package in config.h.\n");
-    exit(1);
+    if (use_tsc < 0)
+        use_tsc = tsc_usable();
+    cyc_start = read_counter();
 }
 
 double get_counter()
 {
-    printf("ERROR: You are trying to use a get_counter routine in clock.c\n");
-    printf("that has not been implemented yet on this platform.\n");
-    printf("Please choose another timing package in config.h.\n");
-    exit(1);
+    return (double)(read_counter() - cyc_start);
 }
 #endif
 
@@ -179,16 +226,30 @@ double ovhd()
     return result;
 }
 
+/* Read the wall clock in seconds, the best we can */
+static double clock_secs(void)
+{
+    struct timespec ts;
+
+#ifdef CLOCK_MONOTONIC_RAW
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
 /* $begin mhz */
 /* Estimate the clock rate by measuring the cycles that elapse */
-/* while sleeping for sleeptime seconds */
+/* while sleeping for sleeptime seconds, as timed by the wall clock */
 double mhz_full(int verbose, int sleeptime)
 {
-    double rate;
+    double rate, secs;
 
+    secs = clock_secs();
     start_counter();
     sleep(sleeptime);
-    rate = get_counter() / (1e6*sleeptime);
+    rate = get_counter() / (1e6*(clock_secs() - secs));
     if (verbose)
         printf("Processor clock rate ~= %.1f MHz\n", rate);
     return rate;
@@ -198,7 +259,7 @@ double mhz_full(int verbose, int sleeptime)
 /* Version using a default sleeptime */
 double mhz(int verbose)
 {
-    return mhz_full(verbose, 2);
+    return mhz_full(verbose, 1);
 }
 
 /** Special counters that compensate for timer interrupt overhead */
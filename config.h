@@ -42,7 +42,9 @@
   "cccp-bal.rep",\
   "cp-decl-bal.rep",\
   "expr-bal.rep",\
-  "coalescing-bal.rep"
+  "coalescing-bal.rep",\
+  "realloc-bal.rep",\
+  "realloc2-bal.rep"
 #endif
 
 /*
@@ -64,9 +66,9 @@
 #define UTIL_WEIGHT .60
 
 /*
- * Alignment requirement in bytes (either 4 or 8)
+ * Alignment requirement in bytes (either 4, 8 or 16)
  */
-#define ALIGNMENT 8
+#define ALIGNMENT 16
 
 /*
  * Maximum heap size in bytes
@@ -76,8 +78,15 @@
 /*****************************************************************************
  * Set exactly one of these USE_xxx constants to "1" to select a timing method
  *****************************************************************************/
-#define USE_FCYC   0   /* cycle counter w/K-best scheme (x86 & Alpha only) */
+#define USE_FCYC   1   /* cycle counter w/K-best scheme (x86 & x86-64 TSC, */
+                       /* Alpha, and CLOCK_MONOTONIC_RAW elsewhere) */
 #define USE_ITIMER 0   /* interval timer (any Unix box) */
-#define USE_GETTOD 1   /* gettimeofday (any Unix box) */
+#define USE_GETTOD 0   /* gettimeofday (any Unix box) */
+
+/*
+ * With USE_FCYC, each timed sample repeats a trace until it lasts at
+ * least this many seconds, so that short traces are not lost in noise
+ */
+#define MIN_WINDOW 0.002
 
 #endif /* __CONFIG_H */
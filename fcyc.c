@@ -22,6 +22,8 @@
 #define CLEAR_CACHE 0        /* Clear cache before running test function */
 #define CACHE_BYTES (1<<19)  /* Max cache size in bytes */
 #define CACHE_BLOCK 32       /* Cache block size in bytes */
+#define MIN_CYCLES 0         /* Run f repeatedly for at least this long */
+#define MAXREPS (1<<20)      /* ... but at most this many times */
 
 static int kbest = K;
 static int maxsamples = MAXSAMPLES;
@@ -30,8 +32,9 @@ static int compensate = COMPENSATE;
 static int clear_cache = CLEAR_CACHE;
 static int cache_bytes = CACHE_BYTES;
 static int cache_block = CACHE_BLOCK;
+static double min_cycles = MIN_CYCLES;
 
-static int *cache_buf = NULL;
+static unsigned *cache_buf = NULL;
 
 static double *values = NULL;
 static int samplecount = 0;
@@ -100,22 +103,22 @@ static int has_converged()
 /*
  * clear - Code to clear cache
  */
-static volatile int sink = 0;
+static volatile unsigned sink = 0;
 
 static void clear()
 {
-    int x = sink;
-    int *cptr, *cend;
-    int incr = cache_block/sizeof(int);
+    unsigned x = sink;  /* unsigned, so the sum wraps rather than overflows */
+    unsigned *cptr, *cend;
+    int incr = cache_block/sizeof(unsigned);
     if (!cache_buf) {
-        cache_buf = malloc(cache_bytes);
+        cache_buf = calloc(1, cache_bytes);
         if (!cache_buf) {
-            fprintf(stderr, "Fatal error.  Malloc returned null when trying to clear cache\n");
+            fprintf(stderr, "Fatal error.  Calloc returned null when trying to clear cache\n");
             exit(1);
         }
     }
-    cptr = (int *) cache_buf;
-    cend = cptr + cache_bytes/sizeof(int);
+    cptr = (unsigned *) cache_buf;
+    cend = cptr + cache_bytes/sizeof(unsigned);
     while (cptr < cend) {
         x += *cptr;
         cptr += incr;
@@ -123,12 +126,34 @@ static void clear()
     sink = x;
 }
 
+/*
+ * fcyc_reps - Find how many runs of f it takes to last min_cycles,
+ *     so that the timer's resolution does not swamp a short f
+ */
+static int fcyc_reps(test_funct f, void *argp)
+{
+    int reps, i;
+
+    for (reps = 1; reps < MAXREPS; reps *= 2) {
+        start_counter();
+        for (i = 0; i < reps; i++)
+            f(argp);
+        if (get_counter() >= min_cycles)
+            break;
+    }
+    return reps;
+}
+
 /*
  * fcyc - Use K-best scheme to estimate the running time of function f
  */
 double fcyc(test_funct f, void *argp)
 {
     double result;
+    int reps = 1, i;
+
+    if (min_cycles > 0)
+        reps = fcyc_reps(f, argp);
     init_sampler();
     if (compensate) {
         do {
@@ -136,9 +161,10 @@ double fcyc(test_funct f, void *argp)
             if (clear_cache)
                 clear();
             start_comp_counter();
-            f(argp);
+            for (i = 0; i < reps; i++)
+                f(argp);
             cyc = get_comp_counter();
-            add_sample(cyc);
+            add_sample(cyc / reps);
         } while (!has_converged() && samplecount < maxsamples);
     } else {
         do {
@@ -146,9 +172,10 @@ double fcyc(test_funct f, void *argp)
             if (clear_cache)
                 clear();
             start_counter();
-            f(argp);
+            for (i = 0; i < reps; i++)
+                f(argp);
             cyc = get_counter();
-            add_sample(cyc);
+            add_sample(cyc / reps);
         } while (!has_converged() && samplecount < maxsamples);
     }
 #ifdef DEBUG
@@ -245,6 +272,17 @@ void set_fcyc_epsilon(double epsilon_arg)
     epsilon = epsilon_arg;
 }
 
+/*
+ * set_fcyc_min_cycles - Each sample runs the test function as many
+ *     times as it takes to last at least this many cycles, and counts
+ *     the average. 0 runs it once.
+ *     Default = 0
+ */
+void set_fcyc_min_cycles(double cycles)
+{
+    min_cycles = cycles;
+}
+
 
 
 
@@ -63,6 +63,14 @@ void set_fcyc_maxsamples(int maxsamples_arg);
  */
 void set_fcyc_epsilon(double epsilon_arg);
 
+/*
+ * set_fcyc_min_cycles - Each sample runs the test function as many
+ *     times as it takes to last at least this many cycles, and counts
+ *     the average. 0 runs it once.
+ *     Default = 0
+ */
+void set_fcyc_min_cycles(double cycles);
+
 
 
 
@@ -26,10 +26,11 @@ void init_fsecs(void)
     /* set key parameters for the fcyc package */
     set_fcyc_maxsamples(20);
     set_fcyc_clear_cache(1);
-    set_fcyc_compensate(1);
+    set_fcyc_compensate(0);
     set_fcyc_epsilon(0.01);
     set_fcyc_k(3);
     Mhz = mhz(verbose > 0);
+    set_fcyc_min_cycles(MIN_WINDOW * Mhz * 1e6);
 #elif USE_ITIMER
     if (verbose)
         printf("Measuring performance with the interval timer.\n");
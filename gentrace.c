@@ -0,0 +1,480 @@
+/*
+ * gentrace.c - Generate a synthetic trace file from a parametric model
+ *
+ * Usage: gentrace [-b] [-n <ops>] [-H <bytes>] [-z <sizes>]... [-l <life>]...
+ *            [-p <phases>] [-r <frac>] [-g <growth>] [-L <frac>] [-S <seed>]
+ *            [-o <file>]
+ *
+ * Blocks are allocated while the live heap is below its target size
+ * and freed while it is above, so the live heap hovers around the
+ * target once it is reached. The trace is split into phases of equal
+ * length, which cycle through the given size and lifetime models.
+ * Blocks still live at the end are freed then, so that every trace is
+ * balanced. The same options and seed always give the same trace.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define MAXMODELS 16  /* max number of -z or -l options */
+
+/* A size distribution */
+typedef struct {
+  enum {FIXED, UNIFORM, BIMODAL, POWER} kind;
+  double a, b, c;     /* parameters, see usage() */
+} size_model_t;
+
+/* Which live block a free or realloc picks */
+enum {LIFO, FIFO, RANDOM};
+
+/* A live block */
+typedef struct {
+  unsigned id;
+  int size;
+} block_t;
+
+/* The parameters of a trace */
+static long num_requests = 100000;
+static double target = 1 << 20;
+static size_model_t sizes[MAXMODELS];
+static int num_sizes = 0;
+static int lives[MAXMODELS];
+static int num_lives = 0;
+static int phases = 1;
+static double realloc_frac = 0;
+static double growth = 1.5;
+static double long_frac = 0;
+static unsigned long long seed = 1;
+
+/* The state of the generator */
+static unsigned long long rng;
+static block_t *live;         /* live blocks, a deque from head to tail */
+static long live_cap, head, tail;
+static block_t *longlived;    /* live blocks that are only freed at the end */
+static long long_count, long_cap;
+static double live_bytes;
+static unsigned num_ids;
+static long num_ops;
+
+/*
+ * next_rand - Return the next number of the splitmix64 sequence, which
+ *     is the same on every platform
+ */
+static unsigned long long next_rand(void)
+{
+  unsigned long long z = (rng += 0x9e3779b97f4a7c15ULL);
+
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+/* uniform - Return a random number in [0, 1) */
+static double uniform(void)
+{
+  return (next_rand() >> 11) * (1.0 / (1ULL << 53));
+}
+
+/*
+ * draw_size - Draw a block size from model m
+ */
+static int draw_size(size_model_t *m)
+{
+  double x, e;
+
+  switch (m->kind) {
+    case FIXED:
+      x = m->a;
+      break;
+    case UNIFORM:
+      x = m->a + floor(uniform() * (m->b - m->a + 1));
+      break;
+    case BIMODAL:
+      x = (uniform() < m->c) ? m->a : m->b;
+      break;
+    default: /* POWER: invert the CDF of x^-c on [a, b] */
+      e = 1 - m->c;
+      if (fabs(e) < 1e-9)
+        x = m->a * pow(m->b / m->a, uniform());
+      else
+        x = pow(pow(m->a, e) + uniform() * (pow(m->b, e) - pow(m->a, e)),
+            1 / e);
+      break;
+  }
+  return (x < 1) ? 1 : (x > 0x7fffffff) ? 0x7fffffff : (int)x;
+}
+
+/*
+ * emit - Write one request, or just count it if out is NULL
+ */
+static void emit(FILE *out, int binary, unsigned *prev, int type,
+    unsigned id, int size)
+{
+  num_ops++;
+  if (out == NULL)
+    return;
+  if (binary)
+    trace_put_op(out, prev, type, id, size);
+  else if (type == FREE)
+    fprintf(out, "f %u\n", id);
+  else
+    fprintf(out, "%c %u %d\n", (type == ALLOC) ? 'a' : 'r', id, size);
+}
+
+/*
+ * push - Add a block to the end of the live deque
+ */
+static void push(block_t b)
+{
+  block_t *grown;
+  long i, n = tail - head;
+
+  if (tail == live_cap) {
+    /* Move the blocks back to the start, and grow if that is not enough */
+    if (2 * n >= live_cap) {
+      live_cap = live_cap ? 2 * live_cap : 1024;
+      if ((grown = malloc(live_cap * sizeof(block_t))) == NULL) {
+        perror("gentrace");
+        exit(1);
+      }
+    } else {
+      grown = live;
+    }
+    for (i = 0; i < n; i++)
+      grown[i] = live[head + i];
+    if (grown != live)
+      free(live);
+    live = grown;
+    head = 0;
+    tail = n;
+  }
+  live[tail++] = b;
+}
+
+/*
+ * pick - Return the position in the live deque of the block that a free
+ *     or realloc acts on
+ */
+static long pick(int life)
+{
+  long i, n = tail - head;
+  block_t b;
+
+  switch (life) {
+    case LIFO:
+      return tail - 1;
+    case FIFO:
+      return head;
+    default: /* RANDOM: move the block to the end, where it is quick to take */
+      i = head + (long)(uniform() * n);
+      b = live[i];
+      live[i] = live[tail - 1];
+      live[tail - 1] = b;
+      return tail - 1;
+  }
+}
+
+/*
+ * generate - Run the model, writing the requests to out, or only
+ *     counting them and the ids if out is NULL
+ */
+static void generate(FILE *out, int binary)
+{
+  unsigned prev = 0;
+  long i, pos, phase_len;
+  int phase, size, life;
+  size_model_t *m;
+  block_t b;
+  double x;
+
+  rng = seed;
+  head = tail = long_count = 0;
+  live_bytes = 0;
+  num_ids = 0;
+  num_ops = 0;
+  phase_len = (num_requests + phases - 1) / phases;
+
+  for (i = 0; i < num_requests; i++) {
+    phase = i / phase_len;
+    m = &sizes[phase % num_sizes];
+    life = lives[phase % num_lives];
+
+    /* Allocate below the target, and free or realloc above it */
+    if (tail == head || (live_bytes < target) == (uniform() < 0.75)) {
+      b.id = num_ids++;
+      b.size = draw_size(m);
+      emit(out, binary, &prev, ALLOC, b.id, b.size);
+      live_bytes += b.size;
+      if (uniform() < long_frac) {
+        if (long_count == long_cap) {
+          long_cap = long_cap ? 2 * long_cap : 1024;
+          if ((longlived = realloc(longlived, long_cap * sizeof(block_t)))
+              == NULL) {
+            perror("gentrace");
+            exit(1);
+          }
+        }
+        longlived[long_count++] = b;
+      } else {
+        push(b);
+      }
+    } else if (uniform() < realloc_frac) {
+      pos = pick(life);
+      x = live[pos].size * growth;
+      size = (x < 1) ? 1 : (x > 0x7fffffff) ? 0x7fffffff : (int)x;
+      live_bytes += size - live[pos].size;
+      live[pos].size = size;
+      emit(out, binary, &prev, REALLOC, live[pos].id, size);
+    } else {
+      pos = pick(life);
+      b = live[pos];
+      if (pos == head)
+        head++;
+      else
+        tail--;   /* pick() returns the head or the tail */
+      live_bytes -= b.size;
+      emit(out, binary, &prev, FREE, b.id, 0);
+    }
+  }
+
+  /* Free whatever is left */
+  while (tail > head) {
+    b = live[--tail];
+    emit(out, binary, &prev, FREE, b.id, 0);
+  }
+  while (long_count > 0) {
+    b = longlived[--long_count];
+    emit(out, binary, &prev, FREE, b.id, 0);
+  }
+}
+
+/*
+ * usage - Explain the command line arguments
+ */
+static void usage(void)
+{
+  fprintf(stderr, "Usage: gentrace [-b] [-n <ops>] [-H <bytes>] "
+      "[-z <sizes>]... [-l <life>]...\n"
+      "           [-p <phases>] [-r <frac>] [-g <growth>] [-L <frac>] "
+      "[-S <seed>] [-o <file>]\n");
+  fprintf(stderr, "Options\n");
+  fprintf(stderr, "\t-b          Write a binary trace.\n");
+  fprintf(stderr, "\t-g <growth> Factor by which realloc resizes (1.5).\n");
+  fprintf(stderr, "\t-H <bytes>  Target live heap size (1M).\n");
+  fprintf(stderr, "\t-l <life>   Lifetimes: lifo, fifo or random (random).\n");
+  fprintf(stderr, "\t-L <frac>   Fraction of blocks live to the end (0).\n");
+  fprintf(stderr, "\t-n <ops>    Requests before the final frees (100000).\n");
+  fprintf(stderr, "\t-o <file>   Write the trace to <file> (stdout).\n");
+  fprintf(stderr, "\t-p <phases> Number of phases (1).\n");
+  fprintf(stderr, "\t-r <frac>   Fraction of frees that are reallocs (0).\n");
+  fprintf(stderr, "\t-S <seed>   Seed of the random numbers (1).\n");
+  fprintf(stderr, "\t-z <sizes>  Sizes: fixed:N, uniform:MIN,MAX, "
+      "bimodal:A,B,P (A with\n"
+      "\t            probability P) or power:MIN,MAX,ALPHA "
+      "(uniform:1,4096).\n");
+  fprintf(stderr, "\t-l and -z may be repeated; phases cycle through them.\n");
+  fprintf(stderr, "\tSizes in bytes may end with K, M or G.\n");
+}
+
+/*
+ * parse_num - Parse a number at *s and advance *s past it. If size is
+ *     set, the number is a size in bytes and may end with a K, M or G
+ *     suffix. Return 0 if there is no number at *s.
+ */
+static int parse_num(char **s, double *x, int size)
+{
+  char *end;
+
+  errno = 0;
+  *x = strtod(*s, &end);
+  if (end == *s || errno)
+    return 0;
+  if (size) {
+    switch (*end) {
+      case 'K': case 'k':
+        *x *= 1 << 10;
+        end++;
+        break;
+      case 'M': case 'm':
+        *x *= 1 << 20;
+        end++;
+        break;
+      case 'G': case 'g':
+        *x *= 1 << 30;
+        end++;
+        break;
+    }
+  }
+  *s = end;
+  return 1;
+}
+
+/*
+ * arg_num - Return the number that is the whole of an option argument,
+ *     or explain the usage and exit if it is not one
+ */
+static double arg_num(char *arg, int size)
+{
+  double x;
+
+  if (!parse_num(&arg, &x, size) || *arg) {
+    usage();
+    exit(1);
+  }
+  return x;
+}
+
+/*
+ * parse_sizes - Parse the argument of -z
+ */
+static int parse_sizes(char *arg, size_model_t *m)
+{
+  char *s = strchr(arg, ':');
+
+  if (s == NULL)
+    return 0;
+  s++;
+  if (!strncmp(arg, "fixed:", 6)) {
+    m->kind = FIXED;
+    if (!parse_num(&s, &m->a, 1))
+      return 0;
+  } else if (!strncmp(arg, "uniform:", 8)) {
+    m->kind = UNIFORM;
+    if (!parse_num(&s, &m->a, 1) || *s++ != ',' ||
+        !parse_num(&s, &m->b, 1) || m->a > m->b)
+      return 0;
+  } else if (!strncmp(arg, "bimodal:", 8)) {
+    m->kind = BIMODAL;
+    if (!parse_num(&s, &m->a, 1) || *s++ != ',' ||
+        !parse_num(&s, &m->b, 1) || *s++ != ',' ||
+        !parse_num(&s, &m->c, 0) || !(m->c >= 0 && m->c <= 1))
+      return 0;
+  } else if (!strncmp(arg, "power:", 6)) {
+    m->kind = POWER;
+    if (!parse_num(&s, &m->a, 1) || *s++ != ',' ||
+        !parse_num(&s, &m->b, 1) || *s++ != ',' ||
+        !parse_num(&s, &m->c, 0) || m->a < 1 || m->a > m->b)
+      return 0;
+  } else
+    return 0;
+  return *s == '\0';
+}
+
+int main(int argc, char **argv)
+{
+  FILE *out = stdout;
+  char *outname = NULL;
+  int binary = 0;
+  int heapsize;
+  char *end;
+  int c;
+
+  while ((c = getopt(argc, argv, "bg:H:l:L:n:o:p:r:S:z:h")) != EOF) {
+    switch (c) {
+      case 'b':
+        binary = 1;
+        break;
+      case 'g':
+        growth = arg_num(optarg, 0);
+        break;
+      case 'H':
+        target = arg_num(optarg, 1);
+        break;
+      case 'l':
+        if (num_lives == MAXMODELS) {
+          usage();
+          exit(1);
+        }
+        if (!strcmp(optarg, "lifo"))
+          lives[num_lives++] = LIFO;
+        else if (!strcmp(optarg, "fifo"))
+          lives[num_lives++] = FIFO;
+        else if (!strcmp(optarg, "random"))
+          lives[num_lives++] = RANDOM;
+        else {
+          usage();
+          exit(1);
+        }
+        break;
+      case 'L':
+        long_frac = arg_num(optarg, 0);
+        break;
+      case 'n':
+        num_requests = (long)arg_num(optarg, 0);
+        break;
+      case 'o':
+        outname = optarg;
+        break;
+      case 'p':
+        phases = (int)arg_num(optarg, 0);
+        break;
+      case 'r':
+        realloc_frac = arg_num(optarg, 0);
+        break;
+      case 'S':
+        errno = 0;
+        seed = strtoull(optarg, &end, 0);
+        if (end == optarg || *end || errno) {
+          usage();
+          exit(1);
+        }
+        break;
+      case 'z':
+        if (num_sizes == MAXMODELS || !parse_sizes(optarg, &sizes[num_sizes])) {
+          usage();
+          exit(1);
+        }
+        num_sizes++;
+        break;
+      case 'h':
+        usage();
+        exit(0);
+      default:
+        usage();
+        exit(1);
+    }
+  }
+  if (num_requests < 0 || phases < 1 || growth <= 0 ||
+      !(long_frac >= 0 && long_frac <= 1) ||
+      !(realloc_frac >= 0 && realloc_frac <= 1)) {
+    usage();
+    exit(1);
+  }
+  if (num_sizes == 0) {
+    sizes[0].kind = UNIFORM;
+    sizes[0].a = 1;
+    sizes[0].b = 4096;
+    num_sizes = 1;
+  }
+  if (num_lives == 0)
+    lives[num_lives++] = RANDOM;
+
+  /* Count the requests and ids for the header, then write the trace */
+  generate(NULL, binary);
+  if (num_ops > 0x7fffffffL || num_ids > TRACE_MAX_IDS) {
+    fprintf(stderr, "gentrace: too many requests for a trace\n");
+    exit(1);
+  }
+  if (outname && (out = fopen(outname, "wb")) == NULL) {
+    fprintf(stderr, "Could not open %s: %s\n", outname, strerror(errno));
+    exit(1);
+  }
+  /* The suggested heap size is unused, so it just records the target */
+  heapsize = (target < 0x7fffffff) ? (int)target : 0x7fffffff;
+  if (binary)
+    trace_put_header(out, heapsize, num_ids, num_ops, 1);
+  else
+    fprintf(out, "%d\n%u\n%ld\n1\n", heapsize, num_ids, num_ops);
+  generate(out, binary);
+  if (ferror(out) || fclose(out) == EOF) {
+    fprintf(stderr, "Could not write %s: %s\n",
+        outname ? outname : "the trace", strerror(errno));
+    exit(1);
+  }
+  return 0;
+}
@@ -0,0 +1,84 @@
+/*
+ * hist.c - log-linear latency histograms, see hist.h
+ */
+#include "hist.h"
+
+#define SUB_COUNT (1 << HIST_SUB_BITS)
+
+/*
+ * hist_index - the bucket of value v: values below SUB_COUNT have one
+ *     each, and the values of [2^m, 2^(m+1)) share SUB_COUNT/2 by their
+ *     top HIST_SUB_BITS bits
+ */
+static int hist_index(unsigned long long v)
+{
+    int shift;
+
+    if (v < SUB_COUNT)
+        return v;
+    shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS + 1;
+    return (shift << (HIST_SUB_BITS - 1)) + (int)(v >> shift);
+}
+
+/*
+ * hist_highest - the largest value that falls in bucket i
+ */
+static unsigned long long hist_highest(int i)
+{
+    int shift;
+
+    if (i < SUB_COUNT)
+        return i;
+    shift = (i >> (HIST_SUB_BITS - 1)) - 1;
+    i -= shift << (HIST_SUB_BITS - 1);
+    return ((unsigned long long)(i + 1) << shift) - 1;
+}
+
+/*
+ * hist_add - Count value v
+ */
+void hist_add(hist_t *h, unsigned long long v)
+{
+    h->bucket[hist_index(v)]++;
+    h->count++;
+    if (v > h->max)
+        h->max = v;
+}
+
+/*
+ * hist_merge - Add the counts of src to dst
+ */
+void hist_merge(hist_t *dst, const hist_t *src)
+{
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+        dst->bucket[i] += src->bucket[i];
+    dst->count += src->count;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+/*
+ * hist_percentile - Return the value below which a fraction p of the
+ *     values fall, as the highest value of its bucket, but never more
+ *     than the largest value seen
+ */
+unsigned long long hist_percentile(const hist_t *h, double p)
+{
+    unsigned long long rank, seen = 0, v;
+    int i;
+
+    if (h->count == 0)
+        return 0;
+    rank = (unsigned long long)(p * h->count + 0.5);
+    if (rank < 1)
+        rank = 1;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->bucket[i];
+        if (seen >= rank)
+            break;
+    }
+    v = hist_highest(i);
+    return v < h->max ? v : h->max;
+}
@@ -0,0 +1,24 @@
+/*
+ * hist.h - log-linear latency histograms
+ *
+ * Like an HDR histogram, a hist_t counts values below 2^HIST_SUB_BITS
+ * exactly, and splits every higher power of two into 2^(HIST_SUB_BITS-1)
+ * equal buckets, so that any value is known to within 1/32 of itself.
+ */
+#define HIST_SUB_BITS 6
+#define HIST_BUCKETS  ((64 - HIST_SUB_BITS + 2) << (HIST_SUB_BITS - 1))
+
+typedef struct {
+    unsigned long long count;              /* number of values */
+    unsigned long long max;                /* largest value */
+    unsigned long long bucket[HIST_BUCKETS];
+} hist_t;
+
+/* Count value v */
+void hist_add(hist_t *h, unsigned long long v);
+
+/* Add the counts of src to dst */
+void hist_merge(hist_t *dst, const hist_t *src);
+
+/* Return the value below which a fraction p of the values fall */
+unsigned long long hist_percentile(const hist_t *h, double p);
@@ -7,6 +7,7 @@
  * Copyright (c) 2002, R. Bryant and D. O'Hallaron, All rights reserved.
  * May not be used, modified, or copied without permission.
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -15,9 +16,19 @@
 #include <assert.h>
 #include <float.h>
 #include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 
 #include "mm.h"
 #include "memlib.h"
+#include "range.h"
+#include "trace.h"
+#include "hist.h"
+#include "perf.h"
 #include "fsecs.h"
 #include "config.h"
 
@@ -29,9 +40,14 @@
 #define MAXLINE     1024 /* max string size */
 #define HDRLINES       4 /* number of header lines in a trace file */
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
+#define MAXLEVELS     32 /* max number of thread counts in a threaded run */
+#define XFREE_RING  1024 /* blocks in flight from one thread to the next */
+#define LAT_CLASSES    8 /* size classes of latency histograms: <=16, <=64, */
+                         /* ... <=64K, and larger */
+#define LAT_HISTS (3*LAT_CLASSES) /* latency histograms per malloc package */
 
 /* Returns true if p is ALIGNMENT-byte aligned */
-#define IS_ALIGNED(p)  ((((unsigned int)(p)) % ALIGNMENT) == 0)
+#define IS_ALIGNED(p)  ((((uintptr_t)(p)) % ALIGNMENT) == 0)
 
 /******************************
  * The key compound data types
@@ -45,24 +61,6 @@ typedef struct range_t {
 } range_t;
 */
 
-/* Characterizes a single trace operation (allocator request) */
-typedef struct {
-  enum {ALLOC, FREE, REALLOC} type; /* type of request */
-  int index;                        /* index for free() to use later */
-  int size;                         /* byte size of alloc/realloc request */
-} traceop_t;
-
-/* Holds the information for one trace file*/
-typedef struct {
-  int sugg_heapsize;   /* suggested heap size (unused) */
-  int num_ids;         /* number of alloc/realloc ids */
-  int num_ops;         /* number of distinct requests */
-  int weight;          /* weight for this trace (unused) */
-  traceop_t *ops;      /* array of requests */
-  char **blocks;       /* array of ptrs returned by malloc/realloc... */
-  size_t *block_sizes; /* ... and a corresponding array of payload sizes */
-} trace_t;
-
 /*
  * Holds the params to the xxx_speed functions, which are timed by fcyc.
  * This struct is necessary because fcyc accepts only a pointer array
@@ -73,6 +71,41 @@ typedef struct {
   range_t *ranges;
 } speed_t;
 
+/*
+ * Carries the blocks that one thread of a threaded replay frees on
+ * behalf of the next. It has a single producer and a single consumer,
+ * so it needs no lock.
+ */
+typedef struct {
+  unsigned head __attribute__((aligned(64)));  /* next block to free */
+  unsigned tail __attribute__((aligned(64)));  /* next slot to fill */
+  char *slot[XFREE_RING];
+} xfree_ring_t;
+
+/* Holds the params of one thread of a threaded replay */
+typedef struct {
+  trace_t *trace;         /* this thread's own copy of the trace */
+  int id;                 /* thread number, from 0 */
+  pthread_t tid;
+  xfree_ring_t *inbox;    /* blocks for this thread to free */
+  xfree_ring_t *outbox;   /* blocks for the next thread to free */
+} mt_thread_t;
+
+/* Holds the params to the eval_mt_speed function */
+typedef struct {
+  mt_thread_t *threads;
+  int nthreads;
+  int libc;               /* replay with libc malloc rather than mm? */
+} mt_speed_t;
+
+/* Summarizes a threaded replay of some trace at some thread count */
+typedef struct {
+  int nthreads;    /* number of threads */
+  double ops;      /* number of ops performed by all threads together */
+  double mm_secs;  /* number of secs needed to run them with mm malloc */
+  double libc_secs;/* ... and with libc malloc */
+} mt_stats_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
   /* defined for both libc malloc and student malloc package (mm.c) */
@@ -82,10 +115,30 @@ typedef struct {
 
   /* defined only for the student malloc package */
   double util;     /* space utilization for this trace (always 0 for libc) */
+  double peak;     /* largest heap size in bytes during the trace */
+  double heap;     /* heap size in bytes at the end of the trace */
+
+  /* defined only for the student malloc package, at the end of eval_mm_util */
+  mm_stats_t counters;
+
+  /* defined only with -P, and -1 for events that could not be counted */
+  double perf[PERF_EVENTS]; /* hardware events of one timed run */
 
   /* Note: secs and util are only defined if valid is true */
 } stats_t;
 
+/*
+ * Holds the outcome of checking one trace. The workers of check_traces
+ * write them to memory they share with the driver.
+ */
+typedef struct {
+  int done;        /* was the trace checked to the end? */
+  int taken;       /* did the driver copy the outcome yet? */
+  int errors;      /* number of errors found in it */
+  stats_t libc;    /* ops and valid, for libc malloc */
+  stats_t mm;      /* ops, valid, util, peak and heap, for mm malloc */
+} check_t;
+
 /********************
  * Global variables
  *******************/
@@ -93,9 +146,37 @@ int verbose = 0;        /* global flag for verbose output */
 static int errors = 0;  /* number of errs found when running student malloc */
 char msg[MAXLINE];      /* for whenever we need to compose an error message */
 
+/* The checks of check_traces, and the workers that run them */
+static check_t *checks = NULL;
+static size_t checks_len;
+static int check_jobs = 0;     /* worker processes started */
+static int check_running = 0;  /* worker processes not yet reaped */
+static int check_failed = 0;   /* did a worker fail? */
+static int timing_cpu = -1;    /* CPU the workers keep off, if any */
+
 /* Directory where default tracefiles are found */
 static char tracedir[MAXLINE] = TRACEDIR;
 
+/* Threaded replay mode (set by -T, -s and -x) */
+static int mt_shard = 0;  /* split each trace between the threads? */
+static int mt_xfree = 0;  /* have each thread's frees done by the next? */
+static int mt_libc;       /* replay with libc malloc rather than mm? */
+static int mt_nthreads;   /* number of threads in the current replay */
+static int mt_quit;        /* tells the workers of eval_mt to exit */
+static int mt_finished;    /* threads done with their part of the trace */
+static pthread_barrier_t mt_start, mt_end;
+
+/* Requests between heap checks in eval_mm_valid, 0 for none (set by -C) */
+static int check_every = 0;
+
+/* Fragmentation timeline (set by -F and -I) */
+static int frag_fd = -1;    /* file the samples are appended to */
+static int frag_json = 0;   /* JSON lines rather than CSV? */
+static int frag_every = 1000; /* requests between samples */
+
+/* Cost in ns of reading the clock, which latencies exclude (set by -L) */
+static unsigned long long lat_overhead;
+
 /* The filenames of the default tracefiles */
 static char *default_tracefiles[] = {
   DEFAULT_TRACEFILES, NULL
@@ -106,15 +187,9 @@ static char *default_tracefiles[] = {
  * Function prototypes
  *********************/
 
-/* these functions manipulate range lists */
+/* this function checks and records ranges (see range.h for the others) */
 static int add_range(range_t **ranges, char *lo, int size,
     int tracenum, int opnum);
-static void remove_range(range_t **ranges, char *lo);
-static void clear_ranges(range_t **ranges);
-
-/* These functions read, allocate, and free storage for traces */
-static trace_t *read_trace(char *tracedir, char *filename);
-static void free_trace(trace_t *trace);
 
 /* Routines for evaluating the correctness and speed of libc malloc */
 static int eval_libc_valid(trace_t *trace, int tracenum);
@@ -123,11 +198,40 @@ static void eval_libc_speed(void *ptr);
 /* Routines for evaluating correctnes, space utilization, and speed
    of the student's malloc package in mm.c */
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
+static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges,
+    stats_t *stats);
 static void eval_mm_speed(void *ptr);
 
+/* Check traces in parallel worker processes, while they are timed */
+static void check_traces(char **tracefiles, int n, int jobs, int run_libc);
+static void check_wait(char **tracefiles, int i, stats_t *libc_stats,
+    stats_t *mm_stats);
+static void check_finish(char **tracefiles, int n, stats_t *libc_stats,
+    stats_t *mm_stats);
+static void check_trace(char *filename, int tracenum, int run_libc,
+    check_t *check);
+static void pin_timing(int on);
+
+/* Sample the shape of the heap during eval_mm_util */
+static void frag_sample(FILE *fp, trace_t *trace, int opnum, int payload);
+static void frag_open(char *filename);
+
+/* Time each request of a trace */
+static void eval_latency(trace_t *trace, int libc, hist_t *hists);
+
+/* Replay a trace on several threads at once */
+static void eval_mt(char *filename, int maxthreads, mt_stats_t *stats);
+static void eval_mt_speed(void *ptr);
+static void *mt_worker(void *ptr);
+static void mt_replay(mt_thread_t *thread);
+
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
+static void printheaps(int n, stats_t *stats);
+static void printcounters(int n, stats_t *stats);
+static void printmt(int n, int nlevels, stats_t *valid, mt_stats_t *stats);
+static void printlatency(hist_t *hists);
+static void printperf(int n, stats_t *stats);
 static void usage(void);
 static void unix_error(char *msg);
 static void malloc_error(int tracenum, int opnum, char *msg);
@@ -143,11 +247,20 @@ int main(int argc, char **argv)
   char **tracefiles = NULL;  /* null-terminated array of trace file names */
   int num_tracefiles = 0;    /* the number of traces in that array */
   trace_t *trace = NULL;     /* stores a single trace file in memory */
-  range_t *ranges = NULL;    /* keeps track of block extents for one trace */
   stats_t *libc_stats = NULL;/* libc stats for each trace */
   stats_t *mm_stats = NULL;  /* mm (i.e. student) stats for each trace */
   speed_t speed_params;      /* input parameters to the xx_speed routines */
 
+  hist_t *libc_lat = NULL;   /* libc latency histograms (-L) */
+  hist_t *mm_lat = NULL;     /* mm latency histograms (-L) */
+
+  int latency = 0;     /* If set, time every request (set by -L) */
+  int perfctr = 0;     /* If set, count hardware events (set by -P) */
+  int maxthreads = 0;  /* If set, also replay on up to this many threads */
+  int jobs = 1;        /* number of traces checked at once (set by -j) */
+  int nlevels = 0;     /* number of thread counts replayed on (-T) */
+  mt_stats_t *mt_stats = NULL; /* threaded stats for each trace and count */
+
   int team_check = 1;  /* If set, check team structure (reset by -a) */
   int run_libc = 0;    /* If set, run libc malloc (set by -l) */
   int autograder = 0;  /* If set, emit summary info for autograder (-g) */
@@ -159,11 +272,18 @@ int main(int argc, char **argv)
   /*
    * Read and interpret the command line arguments
    */
-  while ((c = getopt(argc, argv, "f:t:hvVgal")) != EOF) {
+  while ((c = getopt(argc, argv, "C:f:F:I:j:t:T:hvVgaLlPsx")) != EOF) {
     switch (c) {
       case 'g': /* Generate summary info for the autograder */
         autograder = 1;
         break;
+      case 'C': /* Check the heap with mm_check every so many requests */
+        check_every = atoi(optarg);
+        if (check_every < 1) {
+          usage();
+          exit(1);
+        }
+        break;
       case 'f': /* Use one specific trace file only (relative to curr dir) */
         num_tracefiles = 1;
         if ((tracefiles = realloc(tracefiles, 2*sizeof(char *))) == NULL)
@@ -172,6 +292,23 @@ int main(int argc, char **argv)
         tracefiles[0] = strdup(optarg);
         tracefiles[1] = NULL;
         break;
+      case 'F': /* Sample the heap shape into a CSV or JSON lines file */
+        frag_open(optarg);
+        break;
+      case 'I': /* Number of requests between samples of -F */
+        frag_every = atoi(optarg);
+        if (frag_every < 1) {
+          usage();
+          exit(1);
+        }
+        break;
+      case 'j': /* Check up to this many traces at once */
+        jobs = atoi(optarg);
+        if (jobs < 1) {
+          usage();
+          exit(1);
+        }
+        break;
       case 't': /* Directory where the traces are located */
         if (num_tracefiles == 1) /* ignore if -f already encountered */
           break;
@@ -182,9 +319,28 @@ int main(int argc, char **argv)
       case 'a': /* Don't check team structure */
         team_check = 0;
         break;
+      case 'L': /* Time every request, and print latency percentiles */
+        latency = 1;
+        break;
       case 'l': /* Run libc malloc */
         run_libc = 1;
         break;
+      case 'T': /* Also replay each trace on up to this many threads */
+        maxthreads = atoi(optarg);
+        if (maxthreads < 1) {
+          usage();
+          exit(1);
+        }
+        break;
+      case 'P': /* Count hardware events of the timed runs */
+        perfctr = 1;
+        break;
+      case 's': /* Split each trace between the threads of -T */
+        mt_shard = 1;
+        break;
+      case 'x': /* Free blocks on another thread than malloc'd them */
+        mt_xfree = 1;
+        break;
       case 'v': /* Print per-trace performance breakdown */
         verbose = 1;
         break;
@@ -225,6 +381,43 @@ int main(int argc, char **argv)
 
   /* Initialize the timing package */
   init_fsecs();
+  if (perfctr && init_perf() == 0) {
+    printf("No hardware event counters are available; ignoring -P.\n");
+    perfctr = 0;
+  }
+  if (latency) {
+    libc_lat = (hist_t *)calloc(LAT_HISTS, sizeof(hist_t));
+    mm_lat = (hist_t *)calloc(LAT_HISTS, sizeof(hist_t));
+    if (libc_lat == NULL || mm_lat == NULL)
+      unix_error("latency histogram calloc in main failed");
+  }
+
+  /* Allocate the stats arrays, with one stats_t struct per tracefile */
+  libc_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
+  mm_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
+  if (libc_stats == NULL || mm_stats == NULL)
+    unix_error("stats calloc in main failed");
+
+  /* Allocate the threaded stats, for 1, 2, 4, ... and maxthreads threads */
+  if (maxthreads) {
+    while (nlevels < MAXLEVELS - 1 && (1 << nlevels) < maxthreads)
+      nlevels++;
+    nlevels++;
+    mt_stats = (mt_stats_t *)calloc(num_tracefiles * nlevels,
+        sizeof(mt_stats_t));
+    if (mt_stats == NULL)
+      unix_error("mt_stats calloc in main failed");
+  }
+
+  /* Initialize the simulated memory system in memlib.c */
+  mem_init();
+
+  /*
+   * Check every trace for correctness, and the mm package's space
+   * utilization on it, on up to jobs worker processes at once. The
+   * valid traces are timed, one at a time, as soon as they are checked.
+   */
+  check_traces(tracefiles, num_tracefiles, jobs, run_libc);
 
   /*
    * Optionally run and evaluate the libc malloc package
@@ -233,24 +426,22 @@ int main(int argc, char **argv)
     if (verbose > 1)
       printf("\nTesting libc malloc\n");
 
-    /* Allocate libc stats array, with one stats_t struct per tracefile */
-    libc_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
-    if (libc_stats == NULL)
-      unix_error("libc_stats calloc in main failed");
-
     /* Evaluate the libc malloc package using the K-best scheme */
     for (i=0; i < num_tracefiles; i++) {
-      trace = read_trace(tracedir, tracefiles[i]);
-      libc_stats[i].ops = trace->num_ops;
+      check_wait(tracefiles, i, libc_stats, mm_stats);
+      if (!libc_stats[i].valid)
+        continue;
       if (verbose > 1)
-        printf("Checking libc malloc for correctness, ");
-      libc_stats[i].valid = eval_libc_valid(trace, i);
-      if (libc_stats[i].valid) {
-        speed_params.trace = trace;
-        if (verbose > 1)
-          printf("and performance.\n");
-        libc_stats[i].secs = fsecs(eval_libc_speed, &speed_params);
-      }
+        printf("Timing libc malloc on %s.\n", tracefiles[i]);
+      trace = read_trace(tracedir, tracefiles[i]);
+      speed_params.trace = trace;
+      pin_timing(1);
+      libc_stats[i].secs = fsecs(eval_libc_speed, &speed_params);
+      if (perfctr)
+        perf_measure(eval_libc_speed, &speed_params, libc_stats[i].perf);
+      if (latency)
+        eval_latency(trace, 1, libc_lat);
+      pin_timing(0);
       free_trace(trace);
     }
 
@@ -259,6 +450,14 @@ int main(int argc, char **argv)
       printf("\nResults for libc malloc:\n");
       printresults(num_tracefiles, libc_stats);
     }
+    if (perfctr) {
+      printf("\nHardware events per request for libc malloc:\n");
+      printperf(num_tracefiles, libc_stats);
+    }
+    if (latency) {
+      printf("\nLatency of libc malloc requests in ns:\n");
+      printlatency(libc_lat);
+    }
   }
 
   /*
@@ -267,38 +466,64 @@ int main(int argc, char **argv)
   if (verbose > 1)
     printf("\nTesting mm malloc\n");
 
-  /* Allocate the mm stats array, with one stats_t struct per tracefile */
-  mm_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
-  if (mm_stats == NULL)
-    unix_error("mm_stats calloc in main failed");
-
-  /* Initialize the simulated memory system in memlib.c */
-  mem_init();
-
   /* Evaluate student's mm malloc package using the K-best scheme */
   for (i=0; i < num_tracefiles; i++) {
-    trace = read_trace(tracedir, tracefiles[i]);
-    mm_stats[i].ops = trace->num_ops;
+    check_wait(tracefiles, i, libc_stats, mm_stats);
+    if (!mm_stats[i].valid)
+      continue;
     if (verbose > 1)
-      printf("Checking mm_malloc for correctness, ");
-    mm_stats[i].valid = eval_mm_valid(trace, i, &ranges);
-    if (mm_stats[i].valid) {
-      if (verbose > 1)
-        printf("efficiency, ");
-      mm_stats[i].util = eval_mm_util(trace, i, &ranges);
-      speed_params.trace = trace;
-      speed_params.ranges = ranges;
+      printf("Timing mm malloc on %s.\n", tracefiles[i]);
+    trace = read_trace(tracedir, tracefiles[i]);
+    speed_params.trace = trace;
+    pin_timing(1);
+    mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
+    if (perfctr)
+      perf_measure(eval_mm_speed, &speed_params, mm_stats[i].perf);
+    if (latency)
+      eval_latency(trace, 0, mm_lat);
+    pin_timing(0);
+    free_trace(trace);
+
+    /* Optionally replay it on several threads at once as well */
+    if (maxthreads) {
       if (verbose > 1)
-        printf("and performance.\n");
-      mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
+        printf("Replaying on up to %d threads.\n", maxthreads);
+      check_finish(tracefiles, num_tracefiles, libc_stats, mm_stats);
+      eval_mt(tracefiles[i], maxthreads, &mt_stats[i * nlevels]);
     }
-    free_trace(trace);
   }
 
+  check_finish(tracefiles, num_tracefiles, libc_stats, mm_stats);
+
   /* Display the mm results in a compact table */
   if (verbose) {
     printf("\nResults for mm malloc:\n");
     printresults(num_tracefiles, mm_stats);
+    printf("\nHeap footprint for mm malloc:\n");
+    printheaps(num_tracefiles, mm_stats);
+    printf("\n");
+  }
+  if (verbose > 1) {
+    printcounters(num_tracefiles, mm_stats);
+    printf("\n");
+  }
+  if (perfctr) {
+    printf("Hardware events per request for mm malloc:\n");
+    printperf(num_tracefiles, mm_stats);
+    printf("\n");
+  }
+  if (latency) {
+    printf("Latency of mm malloc requests in ns:\n");
+    printlatency(mm_lat);
+    printf("\n");
+  }
+
+  /* Display the threaded results, which -T asks for, in any case */
+  if (maxthreads) {
+    printf("Results for %s on up to %d threads%s:\n",
+        mt_shard ? "sharded traces" : "trace copies", maxthreads,
+        mt_xfree ? ", with cross-thread frees" : "");
+    printmt(num_tracefiles, nlevels, mm_stats, mt_stats);
     printf("\n");
   }
 
@@ -357,7 +582,8 @@ int main(int argc, char **argv)
 /*****************************************************************
  * The following routines manipulate the range list, which keeps
  * track of the extent of every allocated block payload. We use the
- * range list to detect any overlapping allocated blocks.
+ * range list to detect any overlapping allocated blocks. The list
+ * is indexed by range.c, so that each check takes O(log n) time.
  ****************************************************************/
 
 /*
@@ -371,6 +597,7 @@ static int add_range(range_t **ranges, char *lo, int size,
 {
   char *hi = lo + size - 1;
   range_t *p;
+  int region;
   char msg[MAXLINE];
 
   assert(size > 0);
@@ -383,191 +610,226 @@ static int add_range(range_t **ranges, char *lo, int size,
     return 0;
   }
 
-  /* The payload must lie within the extent of the heap */
-  if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
-      (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
-    sprintf(msg, "Payload (%p:%p) lies outside heap (%p:%p)",
-        lo, hi, mem_heap_lo(), mem_heap_hi());
+  /* The payload must lie within the extent of one heap region or mapping */
+  region = mem_region_of(lo);
+  if (region < 0) {
+    if (!mem_mapped(lo, hi)) {
+      sprintf(msg, "Payload (%p:%p) lies outside heap (%p:%p)",
+          lo, hi, mem_heap_lo(), mem_heap_hi());
+      malloc_error(tracenum, opnum, msg);
+      return 0;
+    }
+  }
+  else if ((lo < (char *)mem_region_lo(region)) ||
+      (lo > (char *)mem_region_hi(region)) ||
+      (hi < (char *)mem_region_lo(region)) ||
+      (hi > (char *)mem_region_hi(region))) {
+    sprintf(msg, "Payload (%p:%p) lies outside heap region %d (%p:%p)",
+        lo, hi, region, mem_region_lo(region), mem_region_hi(region));
     malloc_error(tracenum, opnum, msg);
     return 0;
   }
 
   /* The payload must not overlap any other payloads */
-  for (p = *ranges;  p != NULL;  p = p->next) {
-    if ((lo >= p->lo && lo <= p-> hi) ||
-        (hi >= p->lo && hi <= p->hi)) {
-      sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
-          lo, hi, p->lo, p->hi);
-      malloc_error(tracenum, opnum, msg);
-      return 0;
-    }
+  if ((p = find_range(ranges, lo, hi)) != NULL) {
+    sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
+        lo, hi, p->lo, p->hi);
+    malloc_error(tracenum, opnum, msg);
+    return 0;
   }
 
   /*
    * Everything looks OK, so remember the extent of this block
-   * by creating a range struct and adding it the range list.
+   * by adding it to the range list.
    */
-  if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
-    unix_error("malloc error in add_range");
-  p->next = *ranges;
-  p->lo = lo;
-  p->hi = hi;
-  *ranges = p;
+  insert_range(ranges, lo, hi);
   return 1;
 }
 
+
+/**********************************************************************
+ * The following functions evaluate the correctness, space utilization,
+ * and throughput of the libc and mm malloc packages.
+ **********************************************************************/
+
 /*
- * remove_range - Free the range record of block whose payload starts at lo
+ * check_traces - Start checking each of n traces for correctness with
+ *     both malloc packages (libc's only if run_libc is set), and measure
+ *     the space utilization of the mm package on it. Up to jobs worker
+ *     processes, each with its own copy of the simulated memory and of
+ *     the mm package's state, take traces in turn until none are left,
+ *     while the driver times the traces they are done with. The workers
+ *     keep off the CPU that the driver times on, if there are others.
+ *     With a single job, the driver checks all the traces itself first.
  */
-static void remove_range(range_t **ranges, char *lo)
+static void check_traces(char **tracefiles, int n, int jobs, int run_libc)
 {
-  range_t *p;
-  range_t **prevpp = ranges;
+  int *next;    /* next trace to check */
+  int i;
+  pid_t pid;
+#ifdef __linux__
+  cpu_set_t cpus;
+#endif
+
+  checks_len = n * sizeof(check_t) + sizeof(int);
+  checks = mmap(NULL, checks_len, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (checks == MAP_FAILED)
+    unix_error("mmap in check_traces failed");
+  next = (int *)(checks + n);
+
+  if (jobs > n)
+    jobs = n;
+  if (jobs <= 1) {
+    for (i = 0; i < n; i++)
+      check_trace(tracefiles[i], i, run_libc, &checks[i]);
+    return;
+  }
 
-  for (p = *ranges;  p != NULL; p = p->next) {
-    if (p->lo == lo) {
-      *prevpp = p->next;
-      free(p);
-      break;
+#ifdef __linux__
+  /* Reserve the CPU the driver is on for the timing */
+  if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0 &&
+      CPU_COUNT(&cpus) > 1 && (timing_cpu = sched_getcpu()) >= 0)
+    CPU_CLR(timing_cpu, &cpus);
+#endif
+
+  fflush(stdout);
+  for (i = 0; i < jobs; i++) {
+    if ((pid = fork()) < 0)
+      unix_error("fork in check_traces failed");
+    if (pid == 0) {
+#ifdef __linux__
+      if (timing_cpu >= 0)
+        sched_setaffinity(0, sizeof(cpus), &cpus);
+#endif
+      while ((i = __atomic_fetch_add(next, 1, __ATOMIC_RELAXED)) < n)
+        check_trace(tracefiles[i], i, run_libc, &checks[i]);
+      exit(0);
     }
-    prevpp = &(p->next);
   }
+  check_jobs = check_running = jobs;
 }
 
 /*
- * clear_ranges - free all of the range records for a trace
+ * check_wait - Wait until trace i has been checked, and copy its
+ *     outcome to libc_stats[i] and mm_stats[i] the first time. Exits
+ *     if the workers all stopped before they checked it. Once
+ *     check_finish has run, every outcome has been copied already.
  */
-static void clear_ranges(range_t **ranges)
+static void check_wait(char **tracefiles, int i, stats_t *libc_stats,
+    stats_t *mm_stats)
 {
-  range_t *p;
-  range_t *pnext;
+  int status;
+  pid_t pid;
+
+  if (checks == NULL)
+    return;
+  while (!__atomic_load_n(&checks[i].done, __ATOMIC_ACQUIRE)) {
+    if (check_running == 0) {
+      printf("ERROR: checking %s did not finish\n", tracefiles[i]);
+      exit(1);
+    }
+    if ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+      check_running--;
+      if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        check_failed = 1;
+    } else if (pid == 0) {
+      usleep(1000);
+    } else {
+      check_running = 0;
+    }
+  }
 
-  for (p = *ranges;  p != NULL;  p = pnext) {
-    pnext = p->next;
-    free(p);
+  if (!checks[i].taken) {
+    checks[i].taken = 1;
+    libc_stats[i] = checks[i].libc;
+    mm_stats[i] = checks[i].mm;
+
+    /* The errors were counted in the workers */
+    if (check_jobs)
+      errors += checks[i].errors;
   }
-  *ranges = NULL;
 }
 
-
-/**********************************************
- * The following routines manipulate tracefiles
- *********************************************/
+/*
+ * check_finish - Wait for the checks of all n traces and for the
+ *     workers to exit, so that nothing else runs while the driver
+ *     replays traces on several threads or sums up. Exits if any
+ *     worker failed.
+ */
+static void check_finish(char **tracefiles, int n, stats_t *libc_stats,
+    stats_t *mm_stats)
+{
+  int i, status;
+
+  if (checks == NULL)
+    return;
+  for (i = 0; i < n; i++)
+    check_wait(tracefiles, i, libc_stats, mm_stats);
+  while (check_running > 0 && wait(&status) > 0) {
+    check_running--;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      check_failed = 1;
+  }
+  munmap(checks, checks_len);
+  checks = NULL;
+  if (check_failed)
+    exit(1);
+}
 
 /*
- * read_trace - read a trace file and store it in memory
+ * check_trace - Check one trace, for check_traces
  */
-static trace_t *read_trace(char *tracedir, char *filename)
+static void check_trace(char *filename, int tracenum, int run_libc,
+    check_t *check)
 {
-  FILE *tracefile;
   trace_t *trace;
-  char type[MAXLINE];
-  char path[MAXLINE];
-  unsigned index, size;
-  unsigned max_index = 0;
-  unsigned op_index;
+  range_t *ranges = NULL;
+  int errors_before = errors;
 
   if (verbose > 1)
-    printf("Reading tracefile: %s\n", filename);
-
-  /* Allocate the trace record */
-  if ((trace = (trace_t *) malloc(sizeof(trace_t))) == NULL)
-    unix_error("malloc 1 failed in read_trance");
-
-  /* Read the trace file header */
-  strncpy(path, tracedir, MAXLINE);
-  strncat(path, filename, MAXLINE);
-  if ((tracefile = fopen(path, "r")) == NULL) {
-    sprintf(msg, "Could not open %s in read_trace", path);
-    unix_error(msg);
-  }
-  if (
-      (fscanf(tracefile, "%d", &(trace->sugg_heapsize)) < 1) || /* not used */
-      (fscanf(tracefile, "%d", &(trace->num_ids)) < 1) ||
-      (fscanf(tracefile, "%d", &(trace->num_ops)) < 1) ||
-      (fscanf(tracefile, "%d", &(trace->weight)) < 1)
-     )
-  {
-    unix_error("failed to read line from trace");
-  }
-
-  /* We'll store each request line in the trace in this array */
-  if ((trace->ops =
-        (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
-    unix_error("malloc 2 failed in read_trace");
-
-  /* We'll keep an array of pointers to the allocated blocks here... */
-  if ((trace->blocks =
-        (char **)malloc(trace->num_ids * sizeof(char *))) == NULL)
-    unix_error("malloc 3 failed in read_trace");
-
-  /* ... along with the corresponding byte sizes of each block */
-  if ((trace->block_sizes =
-        (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL)
-    unix_error("malloc 4 failed in read_trace");
-
-  /* read every request line in the trace file */
-  index = 0;
-  op_index = 0;
-  while (fscanf(tracefile, "%s", type) != EOF) {
-    switch(type[0]) {
-      case 'a':
-        if (fscanf(tracefile, "%u %u", &index, &size) < 2) {
-          unix_error("failed to read line from trace");
-        }
-        trace->ops[op_index].type = ALLOC;
-        trace->ops[op_index].index = index;
-        trace->ops[op_index].size = size;
-        max_index = (index > max_index) ? index : max_index;
-        break;
-      case 'r':
-        if (fscanf(tracefile, "%u %u", &index, &size) < 2) {
-          unix_error("failed to read line from trace");
-        }
-        trace->ops[op_index].type = REALLOC;
-        trace->ops[op_index].index = index;
-        trace->ops[op_index].size = size;
-        max_index = (index > max_index) ? index : max_index;
-        break;
-      case 'f':
-        if (fscanf(tracefile, "%ud", &index) < 1) {
-          unix_error("failed to read line from trace");
-        }
-        trace->ops[op_index].type = FREE;
-        trace->ops[op_index].index = index;
-        break;
-      default:
-        printf("Bogus type character (%c) in tracefile %s\n",
-            type[0], path);
-        exit(1);
-    }
-    op_index++;
-
-  }
-  fclose(tracefile);
-  assert(max_index == trace->num_ids - 1);
-  assert(trace->num_ops == op_index);
-
-  return trace;
+    printf("Checking %s for correctness and efficiency.\n", filename);
+  trace = read_trace(tracedir, filename);
+  check->libc.ops = check->mm.ops = trace->num_ops;
+  if (run_libc)
+    check->libc.valid = eval_libc_valid(trace, tracenum);
+  check->mm.valid = eval_mm_valid(trace, tracenum, &ranges);
+  if (check->mm.valid)
+    check->mm.util = eval_mm_util(trace, tracenum, &ranges, &check->mm);
+  clear_ranges(&ranges);
+  free_trace(trace);
+  check->errors = errors - errors_before;
+  __atomic_store_n(&check->done, 1, __ATOMIC_RELEASE);
 }
 
 /*
- * free_trace - Free the trace record and the three arrays it points
- *              to, all of which were allocated in read_trace().
+ * pin_timing - Keep the driver on one CPU while it times a trace, so
+ *     that the timings do not include migrations, or let it run anywhere
+ *     again. The CPU is the one check_traces reserved, which the workers
+ *     of -j keep off, or else the current one.
  */
-void free_trace(trace_t *trace)
+static void pin_timing(int on)
 {
-  free(trace->ops);         /* free the three arrays... */
-  free(trace->blocks);
-  free(trace->block_sizes);
-  free(trace);              /* and the trace record itself... */
+#ifdef __linux__
+  static cpu_set_t saved;
+  static int pinned = 0;
+  cpu_set_t cpus;
+  int cpu;
+
+  if (on && !pinned) {
+    if ((cpu = timing_cpu >= 0 ? timing_cpu : sched_getcpu()) < 0 ||
+        sched_getaffinity(0, sizeof(saved), &saved) < 0)
+      return;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    pinned = (sched_setaffinity(0, sizeof(cpus), &cpus) == 0);
+  } else if (!on && pinned) {
+    sched_setaffinity(0, sizeof(saved), &saved);
+    pinned = 0;
+  }
+#endif
 }
 
-/**********************************************************************
- * The following functions evaluate the correctness, space utilization,
- * and throughput of the libc and mm malloc packages.
- **********************************************************************/
-
 /*
  * eval_mm_valid - Check the mm malloc package for correctness
  */
@@ -577,6 +839,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
   int index;
   int size;
   int oldsize;
+  traceop_t *op;
   char *newp;
   char *oldp;
   char *p;
@@ -591,12 +854,16 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
     return 0;
   }
 
+  /* Freeing NULL must do nothing, as with free */
+  mm_free(NULL);
+
   /* Interpret each operation in the trace in order */
   for (i = 0;  i < trace->num_ops;  i++) {
-    index = trace->ops[i].index;
-    size = trace->ops[i].size;
+    op = TRACE_OP(trace, i);
+    index = op->index;
+    size = op->size;
 
-    switch (trace->ops[i].type) {
+    switch (op->type) {
 
       case ALLOC: /* mm_malloc */
 
@@ -650,7 +917,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
         oldsize = trace->block_sizes[index];
         if (size < oldsize) oldsize = size;
         for (j = 0; j < oldsize; j++) {
-          if (newp[j] != (index & 0xFF)) {
+          if ((unsigned char)newp[j] != (index & 0xFF)) {
             malloc_error(tracenum, i, "mm_realloc did not preserve the "
                 "data from old block");
             return 0;
@@ -675,6 +942,12 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
         app_error("Nonexistent request type in eval_mm_valid");
     }
 
+    /* Optionally check the consistency of the whole heap */
+    if (check_every && ((i + 1) % check_every == 0 ||
+          i + 1 == trace->num_ops) && !mm_check()) {
+      malloc_error(tracenum, i, "mm_check found the heap inconsistent");
+      return 0;
+    }
   }
 
   /* Call the mm package's exit function */
@@ -697,33 +970,41 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
  *   The idea is to remember the high water mark "hwm" of the heap for
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the
- *   size of the heap in bytes after running the student's malloc
- *   package on the trace. Note that our implementation of mem_sbrk()
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap.
+ *   largest size of the heap in bytes while running the student's
+ *   malloc package on the trace. As mem_sbrk() allows the students to
+ *   decrement the brk pointer, the heap size at the end of the trace
+ *   is recorded in stats as well, to show the effect of trimming.
  *
  */
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
+static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges,
+    stats_t *stats)
 {
   int i;
   int index;
   int size, newsize, oldsize;
   int max_total_size = 0;
   int total_size = 0;
+  traceop_t *op;
   char *p;
   char *newp, *oldp;
+  FILE *frag = NULL;   /* this trace's samples, written out at the end */
+  char *frag_buf;
+  size_t frag_len;
 
   /* initialize the heap and the mm malloc package */
   mem_reset_brk();
   if (mm_init(NULL) < 0)
     app_error("mm_init failed in eval_mm_util");
+  if (frag_fd >= 0 && (frag = open_memstream(&frag_buf, &frag_len)) == NULL)
+    unix_error("open_memstream in eval_mm_util failed");
 
   for (i = 0;  i < trace->num_ops;  i++) {
-    switch (trace->ops[i].type) {
+    op = TRACE_OP(trace, i);
+    switch (op->type) {
 
       case ALLOC: /* mm_alloc */
-        index = trace->ops[i].index;
-        size = trace->ops[i].size;
+        index = op->index;
+        size = op->size;
 
         if ((p = mm_malloc(size)) == NULL)
           app_error("mm_malloc failed in eval_mm_util");
@@ -742,8 +1023,8 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
         break;
 
       case REALLOC: /* mm_realloc */
-        index = trace->ops[i].index;
-        newsize = trace->ops[i].size;
+        index = op->index;
+        newsize = op->size;
         oldsize = trace->block_sizes[index];
 
         oldp = trace->blocks[index];
@@ -764,7 +1045,7 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
         break;
 
       case FREE: /* mm_free */
-        index = trace->ops[i].index;
+        index = op->index;
         size = trace->block_sizes[index];
         p = trace->blocks[index];
 
@@ -780,12 +1061,99 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
         app_error("Nonexistent request type in eval_mm_util");
 
     }
+
+    if (frag && ((i + 1) % frag_every == 0 || i + 1 == trace->num_ops))
+      frag_sample(frag, trace, i + 1, total_size);
+  }
+
+  /*
+   * Append the samples with a single write, so that the workers of
+   * check_traces never interleave the samples of different traces
+   */
+  if (frag) {
+    fclose(frag);
+    if (write(frag_fd, frag_buf, frag_len) != (ssize_t)frag_len)
+      unix_error("write of heap samples failed");
+    free(frag_buf);
   }
 
-  return ((double)max_total_size / (double)mem_heapsize());
+  /* The final heap is measured once the cached blocks are given back */
+  mm_trim();
+  mm_stats(&stats->counters);
+  stats->peak = mem_peak_heapsize();
+  stats->heap = mem_heapsize();
+  return ((double)max_total_size / (double)mem_peak_heapsize());
 }
 
 
+/*
+ * frag_open - Open the file of the fragmentation timeline, and start a
+ *     CSV file with its header line. A file whose name ends in .json
+ *     gets one JSON object per sample and line instead.
+ */
+static void frag_open(char *filename)
+{
+  size_t len = strlen(filename);
+  char line[MAXLINE];
+  int i, n;
+
+  frag_json = len >= 5 && !strcmp(filename + len - 5, ".json");
+  if ((frag_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND,
+          0644)) < 0)
+    unix_error("Could not open the -F file");
+  if (frag_json)
+    return;
+  n = snprintf(line, sizeof(line), "trace,op,payload,heap,used,free,cached,"
+      "largest_free,free_blocks,internal,external");
+  for (i = 0; i < MM_PROFILE_BUCKETS; i++)
+    n += snprintf(line + n, sizeof(line) - n, ",free_%lu", 16ul << i);
+  n += snprintf(line + n, sizeof(line) - n, "\n");
+  if (write(frag_fd, line, n) != n)
+    unix_error("write of heap samples failed");
+}
+
+/*
+ * frag_sample - Sample the shape of the mm heap after request opnum of
+ *     a trace, when the program holds payload bytes, and print it to fp.
+ *     Internal fragmentation is what the blocks in use hold beyond their
+ *     payloads, and external fragmentation the share of free memory
+ *     outside of the largest free block.
+ */
+static void frag_sample(FILE *fp, trace_t *trace, int opnum, int payload)
+{
+  mm_profile_t prof;
+  const char *name = trace->path + strlen(tracedir), *c;
+  double external;
+  int i;
+
+  mm_profile(&prof);
+  external = prof.free ? 1.0 - (double)prof.largest_free / prof.free : 0.0;
+
+  if (frag_json) {
+    fprintf(fp, "{\"trace\": \"");
+    for (c = name; *c; c++)
+      fprintf(fp, (*c == '"' || *c == '\\') ? "\\%c" : "%c", *c);
+    fprintf(fp, "\", \"op\": %d, \"payload\": %d, \"heap\": %zu, "
+        "\"used\": %zu, \"free\": %zu, \"cached\": %zu, "
+        "\"largest_free\": %zu, \"free_blocks\": %zu, "
+        "\"internal\": %ld, \"external\": %.4f, \"free_hist\": [",
+        opnum, payload, prof.heap, prof.used, prof.free, prof.cached,
+        prof.largest_free, prof.free_blocks, (long)prof.used - payload,
+        external);
+    for (i = 0; i < MM_PROFILE_BUCKETS; i++)
+      fprintf(fp, i ? ", %zu" : "%zu", prof.free_hist[i]);
+    fprintf(fp, "]}\n");
+  } else {
+    fprintf(fp, "%s,%d,%d,%zu,%zu,%zu,%zu,%zu,%zu,%ld,%.4f", name, opnum,
+        payload, prof.heap, prof.used, prof.free, prof.cached,
+        prof.largest_free, prof.free_blocks, (long)prof.used - payload,
+        external);
+    for (i = 0; i < MM_PROFILE_BUCKETS; i++)
+      fprintf(fp, ",%zu", prof.free_hist[i]);
+    fprintf(fp, "\n");
+  }
+}
+
 /*
  * eval_mm_speed - This is the function that is used by fcyc()
  *    to measure the running time of the mm malloc package.
@@ -794,6 +1162,7 @@ static void eval_mm_speed(void *ptr)
 {
   int i, index, size, newsize;
   char *p, *newp, *oldp, *block;
+  traceop_t *op;
   trace_t *trace = ((speed_t *)ptr)->trace;
 
   /* Reset the heap and initialize the mm package */
@@ -802,20 +1171,21 @@ static void eval_mm_speed(void *ptr)
     app_error("mm_init failed in eval_mm_speed");
 
   /* Interpret each trace request */
-  for (i = 0;  i < trace->num_ops;  i++)
-    switch (trace->ops[i].type) {
+  for (i = 0;  i < trace->num_ops;  i++) {
+    op = TRACE_OP(trace, i);
+    switch (op->type) {
 
       case ALLOC: /* mm_malloc */
-        index = trace->ops[i].index;
-        size = trace->ops[i].size;
+        index = op->index;
+        size = op->size;
         if ((p = mm_malloc(size)) == NULL)
           app_error("mm_malloc error in eval_mm_speed");
         trace->blocks[index] = p;
         break;
 
       case REALLOC: /* mm_realloc */
-        index = trace->ops[i].index;
-        newsize = trace->ops[i].size;
+        index = op->index;
+        newsize = op->size;
         oldp = trace->blocks[index];
         if ((newp = mm_realloc(oldp,newsize)) == NULL)
           app_error("mm_realloc error in eval_mm_speed");
@@ -823,7 +1193,7 @@ static void eval_mm_speed(void *ptr)
         break;
 
       case FREE: /* mm_free */
-        index = trace->ops[i].index;
+        index = op->index;
         block = trace->blocks[index];
         mm_free(block);
         break;
@@ -831,6 +1201,7 @@ static void eval_mm_speed(void *ptr)
       default:
         app_error("Nonexistent request type in eval_mm_valid");
     }
+  }
 }
 
 /*
@@ -843,30 +1214,32 @@ static int eval_libc_valid(trace_t *trace, int tracenum)
 {
   int i, newsize;
   char *p, *newp, *oldp;
+  traceop_t *op;
 
   for (i = 0;  i < trace->num_ops;  i++) {
-    switch (trace->ops[i].type) {
+    op = TRACE_OP(trace, i);
+    switch (op->type) {
 
       case ALLOC: /* malloc */
-        if ((p = malloc(trace->ops[i].size)) == NULL) {
+        if ((p = malloc(op->size)) == NULL) {
           malloc_error(tracenum, i, "libc malloc failed");
           unix_error("System message");
         }
-        trace->blocks[trace->ops[i].index] = p;
+        trace->blocks[op->index] = p;
         break;
 
       case REALLOC: /* realloc */
-        newsize = trace->ops[i].size;
-        oldp = trace->blocks[trace->ops[i].index];
+        newsize = op->size;
+        oldp = trace->blocks[op->index];
         if ((newp = realloc(oldp, newsize)) == NULL) {
           malloc_error(tracenum, i, "libc realloc failed");
           unix_error("System message");
         }
-        trace->blocks[trace->ops[i].index] = newp;
+        trace->blocks[op->index] = newp;
         break;
 
       case FREE: /* free */
-        free(trace->blocks[trace->ops[i].index]);
+        free(trace->blocks[op->index]);
         break;
 
       default:
@@ -887,21 +1260,23 @@ static void eval_libc_speed(void *ptr)
   int i;
   int index, size, newsize;
   char *p, *newp, *oldp, *block;
+  traceop_t *op;
   trace_t *trace = ((speed_t *)ptr)->trace;
 
   for (i = 0;  i < trace->num_ops;  i++) {
-    switch (trace->ops[i].type) {
+    op = TRACE_OP(trace, i);
+    switch (op->type) {
       case ALLOC: /* malloc */
-        index = trace->ops[i].index;
-        size = trace->ops[i].size;
+        index = op->index;
+        size = op->size;
         if ((p = malloc(size)) == NULL)
           unix_error("malloc failed in eval_libc_speed");
         trace->blocks[index] = p;
         break;
 
       case REALLOC: /* realloc */
-        index = trace->ops[i].index;
-        newsize = trace->ops[i].size;
+        index = op->index;
+        newsize = op->size;
         oldp = trace->blocks[index];
         if ((newp = realloc(oldp, newsize)) == NULL)
           unix_error("realloc failed in eval_libc_speed\n");
@@ -910,7 +1285,7 @@ static void eval_libc_speed(void *ptr)
         break;
 
       case FREE: /* free */
-        index = trace->ops[i].index;
+        index = op->index;
         block = trace->blocks[index];
         free(block);
         break;
@@ -918,6 +1293,323 @@ static void eval_libc_speed(void *ptr)
   }
 }
 
+/*********************************************************************
+ * The following functions time every request of a trace, to find the
+ * tail latencies that the throughput of a whole replay averages away.
+ * The latencies go into histograms by request type and size class.
+ *********************************************************************/
+
+/*
+ * lat_now - read the clock, in ns
+ */
+static inline unsigned long long lat_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * lat_record - count a request of the given type and size, which took
+ *     from start to end
+ */
+static void lat_record(hist_t *hists, int type, int size,
+    unsigned long long start, unsigned long long end)
+{
+  int c = 0;
+
+  while (c < LAT_CLASSES - 1 && size > (16 << 2*c))
+    c++;
+  end -= start;
+  hist_add(&hists[type * LAT_CLASSES + c],
+      end > lat_overhead ? end - lat_overhead : 0);
+}
+
+/*
+ * eval_latency - Replay a trace once with the mm or libc malloc package,
+ *     and count how long each request took in hists
+ */
+static void eval_latency(trace_t *trace, int libc, hist_t *hists)
+{
+  int i, index, size;
+  unsigned long long start, end;
+  traceop_t *op;
+  char *p;
+
+  /* Measure the cost of reading the clock, the first time around */
+  if (lat_overhead == 0) {
+    lat_overhead = ~0ULL;
+    for (i = 0; i < 1000; i++) {
+      start = lat_now();
+      end = lat_now();
+      if (end - start < lat_overhead)
+        lat_overhead = end - start;
+    }
+  }
+
+  /* Reset the heap and initialize the mm package */
+  if (!libc) {
+    mem_reset_brk();
+    if (mm_init(NULL) < 0)
+      app_error("mm_init failed in eval_latency");
+  }
+
+  for (i = 0;  i < trace->num_ops;  i++) {
+    op = TRACE_OP(trace, i);
+    index = op->index;
+    switch (op->type) {
+
+      case ALLOC: /* malloc */
+        size = op->size;
+        start = lat_now();
+        p = libc ? malloc(size) : mm_malloc(size);
+        end = lat_now();
+        if (p == NULL)
+          app_error("malloc failed in eval_latency");
+        trace->blocks[index] = p;
+        trace->block_sizes[index] = size;
+        break;
+
+      case REALLOC: /* realloc */
+        size = op->size;
+        p = trace->blocks[index];
+        start = lat_now();
+        p = libc ? realloc(p, size) : mm_realloc(p, size);
+        end = lat_now();
+        if (p == NULL)
+          app_error("realloc failed in eval_latency");
+        trace->blocks[index] = p;
+        trace->block_sizes[index] = size;
+        break;
+
+      default: /* free */
+        size = trace->block_sizes[index];
+        p = trace->blocks[index];
+        start = lat_now();
+        if (libc)
+          free(p);
+        else
+          mm_free(p);
+        end = lat_now();
+        break;
+    }
+    lat_record(hists, op->type, size, start, end);
+  }
+}
+
+/*********************************************************************
+ * The following functions replay a trace on several threads at once,
+ * to measure how the mm and libc malloc packages scale. Each thread
+ * replays its own copy of the trace, or with -s, the requests for the
+ * block ids that are its own modulo the number of threads. With -x,
+ * each thread hands the blocks it frees to the next thread, which
+ * frees them instead.
+ *********************************************************************/
+
+/*
+ * eval_mt - Time the replay of a trace on 1, 2, 4, ... and maxthreads
+ *     threads, with both the mm and the libc malloc packages
+ */
+static void eval_mt(char *filename, int maxthreads, mt_stats_t *stats)
+{
+  mt_thread_t *threads;
+  xfree_ring_t *rings;
+  mt_speed_t params;
+  int i, n, level;
+
+  /* Give every thread its own copy of the trace and its own inbox */
+  if ((threads = calloc(maxthreads, sizeof(mt_thread_t))) == NULL)
+    unix_error("threads calloc in eval_mt failed");
+  if ((rings = aligned_alloc(64, maxthreads * sizeof(xfree_ring_t))) == NULL)
+    unix_error("rings aligned_alloc in eval_mt failed");
+  for (i = 0; i < maxthreads; i++) {
+    threads[i].trace = read_trace(tracedir, filename);
+    threads[i].id = i;
+  }
+  params.threads = threads;
+
+  for (level = 0, n = 1; n > 0; level++) {
+    for (i = 0; i < n; i++) {
+      rings[i].head = rings[i].tail = 0;
+      threads[i].inbox = &rings[i];
+      threads[i].outbox = &rings[(i + 1) % n];
+    }
+    params.nthreads = n;
+    stats[level].nthreads = n;
+    stats[level].ops = threads[0].trace->num_ops * (double)(mt_shard ? 1 : n);
+
+    /* Start the other threads, which wait for each replay to be timed */
+    mt_nthreads = n;
+    mt_quit = 0;
+    pthread_barrier_init(&mt_start, NULL, n);
+    pthread_barrier_init(&mt_end, NULL, n);
+    for (i = 1; i < n; i++)
+      if (pthread_create(&threads[i].tid, NULL, mt_worker, &threads[i]) != 0)
+        unix_error("pthread_create failed in eval_mt");
+
+    params.libc = 0;
+    stats[level].mm_secs = fsecs(eval_mt_speed, &params);
+    params.libc = 1;
+    stats[level].libc_secs = fsecs(eval_mt_speed, &params);
+
+    /* Release the other threads once more, to exit */
+    mt_quit = 1;
+    pthread_barrier_wait(&mt_start);
+    for (i = 1; i < n; i++)
+      pthread_join(threads[i].tid, NULL);
+    pthread_barrier_destroy(&mt_start);
+    pthread_barrier_destroy(&mt_end);
+
+    /* Go on to the next power of two, and then to maxthreads */
+    n = (n == maxthreads) ? 0 : (2 * n < maxthreads) ? 2 * n : maxthreads;
+  }
+
+  for (i = 0; i < maxthreads; i++)
+    free_trace(threads[i].trace);
+  free(rings);
+  free(threads);
+}
+
+/*
+ * eval_mt_speed - This is the function that is used by fcyc() to
+ *    measure the running time of a threaded replay. The other threads
+ *    are already started by eval_mt, and are only released here, so the
+ *    time ends as the last thread finishes its replay, and includes no
+ *    thread creation or joining.
+ */
+static void eval_mt_speed(void *ptr)
+{
+  mt_speed_t *params = (mt_speed_t *)ptr;
+
+  /* Reset the heap and initialize the mm package */
+  if (!params->libc) {
+    mem_reset_brk();
+    if (mm_init(NULL) < 0)
+      app_error("mm_init failed in eval_mt_speed");
+  }
+
+  mt_libc = params->libc;
+  mt_finished = 0;
+  pthread_barrier_wait(&mt_start);
+  mt_replay(&params->threads[0]);
+}
+
+/*
+ * mt_worker - Run the replays of one of the other threads of eval_mt,
+ *     each released by eval_mt_speed, until told to exit
+ */
+static void *mt_worker(void *ptr)
+{
+  mt_thread_t *thread = (mt_thread_t *)ptr;
+
+  for (;;) {
+    pthread_barrier_wait(&mt_start);
+    if (mt_quit)
+      return NULL;
+    mt_replay(thread);
+  }
+}
+
+/*
+ * mt_free - free a block with the package being replayed
+ */
+static void mt_free(char *p)
+{
+  if (mt_libc)
+    free(p);
+  else
+    mm_free(p);
+}
+
+/*
+ * mt_drain - free the blocks that the previous thread handed over
+ */
+static void mt_drain(xfree_ring_t *ring)
+{
+  unsigned head = ring->head;
+  unsigned tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+  for (; head != tail; head++)
+    mt_free(ring->slot[head % XFREE_RING]);
+  __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+}
+
+/*
+ * mt_handoff - hand a block over to the next thread to free, or free
+ *     it here if that thread has too many blocks to free already
+ */
+static void mt_handoff(xfree_ring_t *ring, char *p)
+{
+  unsigned tail = ring->tail;
+
+  if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == XFREE_RING) {
+    mt_free(p);
+    return;
+  }
+  ring->slot[tail % XFREE_RING] = p;
+  __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * mt_replay - Replay the trace of one thread of a threaded replay, and
+ *     return once every thread has finished its own
+ */
+static void mt_replay(mt_thread_t *thread)
+{
+  trace_t *trace = thread->trace;
+  traceop_t *op;
+  char *p;
+  int i;
+
+  for (i = 0;  i < trace->num_ops;  i++) {
+    op = TRACE_OP(trace, i);
+    if (mt_shard && (int)op->index % mt_nthreads != thread->id)
+      continue;
+    switch (op->type) {
+
+      case ALLOC: /* malloc */
+        p = mt_libc ? malloc(op->size) : mm_malloc(op->size);
+        if (p == NULL)
+          app_error("malloc failed in mt_replay");
+        trace->blocks[op->index] = p;
+        break;
+
+      case REALLOC: /* realloc */
+        p = trace->blocks[op->index];
+        p = mt_libc ? realloc(p, op->size) : mm_realloc(p, op->size);
+        if (p == NULL)
+          app_error("realloc failed in mt_replay");
+        trace->blocks[op->index] = p;
+        break;
+
+      case FREE: /* free */
+        p = trace->blocks[op->index];
+        if (mt_xfree) {
+          mt_handoff(thread->outbox, p);
+          mt_drain(thread->inbox);
+        } else {
+          mt_free(p);
+        }
+        break;
+    }
+  }
+
+  /*
+   * Keep freeing what the previous thread hands over until every thread
+   * is done, so that its blocks are not left in the ring (and its later
+   * ones freed by itself) while this thread waits. Then free those left.
+   */
+  __atomic_add_fetch(&mt_finished, 1, __ATOMIC_ACQ_REL);
+  while (__atomic_load_n(&mt_finished, __ATOMIC_ACQUIRE) < mt_nthreads) {
+    if (mt_xfree)
+      mt_drain(thread->inbox);
+    sched_yield();
+  }
+  mt_drain(thread->inbox);
+  pthread_barrier_wait(&mt_end);
+}
+
 /*************************************
  * Some miscellaneous helper routines
  ************************************/
@@ -980,6 +1672,223 @@ static void printresults(int n, stats_t *stats)
 
 }
 
+/*
+ * printheaps - prints the peak and final heap sizes of the mm package,
+ *     which differ when the package trims the heap
+ */
+static void printheaps(int n, stats_t *stats)
+{
+  int i;
+
+  printf("%5s %7s %10s %10s\n", "trace", " valid", "peakKB", "endKB");
+  for (i=0; i < n; i++) {
+    if (stats[i].valid)
+      printf("%2d %10s %10.1f %10.1f\n",
+          i,
+          "yes",
+          stats[i].peak/1024.0,
+          stats[i].heap/1024.0);
+    else
+      printf("%2d %10s %10s %10s\n", i, "no", "-", "-");
+  }
+}
+
+/*
+ * printcounters - prints the statistics of the mm package at the end of
+ *     eval_mm_util on each trace: how its mallocs were served, the work
+ *     that they and the frees took, and the shape of the heap they left
+ */
+static void printcounters(int n, stats_t *stats)
+{
+  mm_stats_t *c;
+  double m;
+  int i, b;
+
+  printf("Allocator counters for mm malloc (%% of mallocs or frees):\n");
+  printf("%5s %8s %6s %6s %6s %6s %6s %6s %6s %5s %7s %7s %6s %8s %6s %6s "
+      "%6s\n", "trace", "mallocs", "tcache", "quick", "slab", "bin", "larger",
+      "grow", "huge", "scan", "splits", "coalesc", "sbrks", "frees", "tcache",
+      "quick", "remote");
+  for (i = 0; i < n; i++) {
+    c = &stats[i].counters;
+    if (!stats[i].valid) {
+      printf("%2d %10s\n", i, "-");
+      continue;
+    }
+    m = c->mallocs ? c->mallocs / 100.0 : 1;
+    printf("%2d %11llu %6.1f %6.1f %6.1f %6.1f %6.1f %6.1f %6.1f %5.1f %7llu "
+        "%7llu %6llu %8llu %6.1f %6.1f %6.1f\n", i, c->mallocs,
+        c->tcache_hits / m, c->quick_hits / m, c->slab_hits / m,
+        c->bin_hits / m, c->larger_hits / m, c->grow_hits / m,
+        c->huge_mallocs / m,
+        c->searches ? (double)c->scanned / c->searches : 0.0,
+        c->splits, c->coalesces, c->sbrks, c->frees,
+        c->frees ? 100.0 * c->tcache_puts / c->frees : 0.0,
+        c->frees ? 100.0 * c->quick_puts / c->frees : 0.0,
+        c->frees ? 100.0 * c->remote_frees / c->frees : 0.0);
+  }
+
+  printf("\nHeap of mm malloc at the end of each trace:\n");
+  printf("%5s %9s %9s  %s\n", "trace", "allocKB", "freeKB",
+      "free blocks by bin (smallest size:count)");
+  for (i = 0; i < n; i++) {
+    c = &stats[i].counters;
+    if (!stats[i].valid) {
+      printf("%2d %12s\n", i, "-");
+      continue;
+    }
+    printf("%2d %12.1f %9.1f ", i, c->alloc_bytes / 1024.0,
+        c->free_bytes / 1024.0);
+    for (b = 0; b < MM_STATS_BINS; b++)
+      if (c->free_blocks[b])
+        printf(" %d:%llu", (4 + b % 4) << (b / 4 + 2), c->free_blocks[b]);
+    printf("\n");
+  }
+}
+
+/*
+ * printmt - prints the throughput of threaded replays, and how it scales:
+ *     the efficiency at n threads is the throughput at n threads over n
+ *     times the throughput at one thread
+ */
+static void printmt(int n, int nlevels, stats_t *valid, mt_stats_t *stats)
+{
+  int i, level;
+  double ops, mm_secs, libc_secs, mm_one = 0, libc_one = 0;
+  mt_stats_t *s;
+
+  printf("%5s %7s %10s %5s %10s %5s\n",
+      "trace", "threads", "mm Kops", "eff", "libc Kops", "eff");
+  for (i=0; i < n; i++) {
+    if (!valid[i].valid) {
+      printf("%2d %10s %10s %5s %10s %5s\n", i, "-", "-", "-", "-", "-");
+      continue;
+    }
+    for (level = 0; level < nlevels; level++) {
+      s = &stats[i * nlevels + level];
+      if (level == 0) {
+        mm_one = s->ops / s->mm_secs;
+        libc_one = s->ops / s->libc_secs;
+      }
+      printf("%2d %10d %10.0f %4.0f%% %10.0f %4.0f%%\n",
+          i,
+          s->nthreads,
+          (s->ops/1e3)/s->mm_secs,
+          100.0 * s->ops/s->mm_secs / (mm_one * s->nthreads),
+          (s->ops/1e3)/s->libc_secs,
+          100.0 * s->ops/s->libc_secs / (libc_one * s->nthreads));
+    }
+  }
+
+  /* Print the aggregate results at each thread count */
+  for (level = 0; level < nlevels; level++) {
+    ops = mm_secs = libc_secs = 0;
+    for (i=0; i < n; i++) {
+      if (valid[i].valid) {
+        s = &stats[i * nlevels + level];
+        ops += s->ops;
+        mm_secs += s->mm_secs;
+        libc_secs += s->libc_secs;
+      }
+    }
+    if (ops == 0)
+      break;
+    if (level == 0) {
+      mm_one = ops / mm_secs;
+      libc_one = ops / libc_secs;
+    }
+    s = &stats[level];
+    printf("%5s %7d %10.0f %4.0f%% %10.0f %4.0f%%\n",
+        "Total",
+        s->nthreads,
+        (ops/1e3)/mm_secs,
+        100.0 * ops/mm_secs / (mm_one * s->nthreads),
+        (ops/1e3)/libc_secs,
+        100.0 * ops/libc_secs / (libc_one * s->nthreads));
+  }
+}
+
+/*
+ * printlatency - prints the latency percentiles of each request type,
+ *     over all sizes and then by size class
+ */
+static void printlatency(hist_t *hists)
+{
+  static const char *types[] = {"malloc", "free", "realloc"};
+  static const char *classes[LAT_CLASSES] = {
+    "<=16", "<=64", "<=256", "<=1K", "<=4K", "<=16K", "<=64K", ">64K"
+  };
+  hist_t all;
+  hist_t *h;
+  int type, c;
+
+  printf("%-8s %6s %10s %8s %8s %8s %10s\n",
+      "request", "size", "count", "p50", "p99", "p99.9", "max");
+  for (type = 0; type < 3; type++) {
+    memset(&all, 0, sizeof(all));
+    for (c = 0; c < LAT_CLASSES; c++)
+      hist_merge(&all, &hists[type * LAT_CLASSES + c]);
+    if (all.count == 0)
+      continue;
+    for (c = -1; c < LAT_CLASSES; c++) {
+      h = (c < 0) ? &all : &hists[type * LAT_CLASSES + c];
+      if (h->count == 0)
+        continue;
+      printf("%-8s %6s %10llu %8llu %8llu %8llu %10llu\n",
+          types[type],
+          (c < 0) ? "all" : classes[c],
+          h->count,
+          hist_percentile(h, 0.5),
+          hist_percentile(h, 0.99),
+          hist_percentile(h, 0.999),
+          h->max);
+    }
+  }
+}
+
+/*
+ * printperf - prints the hardware events of each timed run per request,
+ *     and the instructions per cycle, or "-" where they were not counted
+ */
+static void printperf(int n, stats_t *stats)
+{
+  int i, j;
+  double ops = 0;
+  double total[PERF_EVENTS] = {0};
+  double *perf;
+
+  printf("%5s", "trace");
+  for (j = 0; j < PERF_EVENTS; j++)
+    printf(" %8s", perf_name(j));
+  printf(" %6s\n", "IPC");
+  for (i=0; i <= n; i++) {
+    if (i < n) {
+      if (!stats[i].valid)
+        continue;
+      printf("%2d   ", i);
+      perf = stats[i].perf;
+      ops = stats[i].ops;
+      for (j = 0; j < PERF_EVENTS; j++)
+        total[j] = (total[j] < 0 || perf[j] < 0) ? -1 : total[j] + perf[j];
+    } else {
+      printf("%5s", "Total");
+      perf = total;
+      for (ops = 0, j = 0; j < n; j++)
+        if (stats[j].valid)
+          ops += stats[j].ops;
+    }
+    for (j = 0; j < PERF_EVENTS; j++)
+      if (perf[j] < 0)
+        printf(" %8s", "-");
+      else
+        printf(" %8.2f", perf[j] / ops);
+    if (perf[PERF_CYCLES] > 0 && perf[PERF_INSTRUCTIONS] >= 0)
+      printf(" %6.2f\n", perf[PERF_INSTRUCTIONS] / perf[PERF_CYCLES]);
+    else
+      printf(" %6s\n", "-");
+  }
+}
+
 /*
  * app_error - Report an arbitrary application error
  */
@@ -1012,14 +1921,25 @@ void malloc_error(int tracenum, int opnum, char *msg)
  */
 static void usage(void)
 {
-  fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+  fprintf(stderr, "Usage: mdriver [-hvVaLlPsx] [-C <n>] [-f <file>] "
+      "[-F <file>] [-I <n>]\n               [-j <n>] [-t <dir>] [-T <n>]\n");
   fprintf(stderr, "Options\n");
   fprintf(stderr, "\t-a         Don't check the team structure.\n");
+  fprintf(stderr, "\t-C <n>     Check the heap every <n> requests.\n");
   fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
+  fprintf(stderr, "\t-F <file>  Write heap shape samples to <file> (CSV, or "
+      "JSON lines if .json).\n");
   fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
   fprintf(stderr, "\t-h         Print this message.\n");
+  fprintf(stderr, "\t-I <n>     Sample the heap every <n> requests under -F.\n");
+  fprintf(stderr, "\t-j <n>     Check up to <n> traces at once.\n");
   fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+  fprintf(stderr, "\t-L         Print the latency percentiles of requests.\n");
+  fprintf(stderr, "\t-P         Count hardware events of timed runs.\n");
+  fprintf(stderr, "\t-s         Split each trace between the threads of -T.\n");
   fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
+  fprintf(stderr, "\t-T <n>     Also replay traces on up to <n> threads.\n");
   fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
   fprintf(stderr, "\t-V         Print additional debug info.\n");
+  fprintf(stderr, "\t-x         Free blocks on another thread under -T.\n");
 }
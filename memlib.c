@@ -2,6 +2,20 @@
  * memlib.c - a module that simulates the memory system.  Needed because it
  *            allows us to interleave calls from the student's malloc package
  *            with the system's malloc package in libc.
+ *
+ *            The simulated memory is made of MEM_REGIONS disjoint regions of
+ *            MAX_HEAP bytes each, every one with its own brk pointer, so that
+ *            independent heaps can grow side by side. The mem_heap_* and
+ *            mem_sbrk functions work on region 0. A region is only ever
+ *            grown or shrunk by one thread at a time (its caller is expected
+ *            to hold a lock for it), but the total size of the regions is
+ *            updated atomically, as regions may be resized concurrently.
+ *
+ *            Besides the regions, mem_map hands out separate mappings of
+ *            any size straight from the OS, which mem_unmap gives back at
+ *            once. They count towards the heap size like the regions, and
+ *            are kept in a list so that mem_mapped can tell whether an
+ *            address range lies in one of them.
  */
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,28 +24,58 @@
 #include <sys/mman.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
 
 #include "memlib.h"
 #include "config.h"
 
+/* a simulated heap region */
+typedef struct {
+    char *start_brk;  /* points to first byte of the region */
+    char *brk;        /* points to last byte of the region */
+    char *max_addr;   /* largest legal address of the region */
+} region_t;
+
+/* a live mapping handed out by mem_map */
+typedef struct mapping {
+    char *lo;              /* first byte of the mapping */
+    size_t size;           /* size of the mapping in bytes */
+    struct mapping *next;
+} mapping_t;
+
 /* private variables */
-static char *mem_start_brk;  /* points to first byte of heap */
-static char *mem_brk;        /* points to last byte of heap */
-static char *mem_max_addr;   /* largest legal heap address */
+static char *mem_start;                   /* first byte of all regions */
+static region_t mem_regions[MEM_REGIONS];
+static size_t mem_total;                  /* sum of the region sizes */
+static size_t mem_peak;                   /* highest mem_total since reset */
+static mapping_t *mem_maps;               /* live mappings */
+static pthread_mutex_t mem_maps_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /*
  * mem_init - initialize the memory system model
  */
 void mem_init(void)
 {
-    /* allocate the storage we will use to model the available VM */
-    if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
-        fprintf(stderr, "mem_init_vm: malloc error\n");
+    int i;
+
+    /*
+     * reserve the storage we will use to model the available VM, pages are
+     * only backed by memory once touched
+     */
+    mem_start = mmap(NULL, (size_t)MEM_REGIONS * MAX_HEAP,
+                     PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem_start == MAP_FAILED) {
+        fprintf(stderr, "mem_init_vm: mmap error\n");
         exit(1);
     }
 
-    mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
-    mem_brk = mem_start_brk;                  /* heap is empty initially */
+    for (i = 0; i < MEM_REGIONS; i++) {
+        mem_regions[i].start_brk = mem_start + (size_t)i * MAX_HEAP;
+        mem_regions[i].max_addr = mem_regions[i].start_brk + MAX_HEAP;
+    }
+    mem_reset_brk();
 }
 
 /*
@@ -39,41 +83,205 @@ void mem_init(void)
  */
 void mem_deinit(void)
 {
-    free(mem_start_brk);
+    mem_reset_brk();
+    munmap(mem_start, (size_t)MEM_REGIONS * MAX_HEAP);
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_reset_brk - reset the simulated brk pointers to make empty heaps,
+ *    and give back any mapping that is still live
  */
 void mem_reset_brk()
 {
-    mem_brk = mem_start_brk;
+    mapping_t *m;
+    int i;
+
+    for (i = 0; i < MEM_REGIONS; i++)
+        mem_regions[i].brk = mem_regions[i].start_brk;
+
+    pthread_mutex_lock(&mem_maps_lock);
+    while ((m = mem_maps) != NULL) {
+        mem_maps = m->next;
+        munmap(m->lo, m->size);
+        free(m);
+    }
+    pthread_mutex_unlock(&mem_maps_lock);
+
+    mem_total = 0;
+    mem_peak = 0;
 }
 
 /*
- * mem_sbrk - simple model of the sbrk function. Extends the heap
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ * mem_grow - add incr bytes (possibly negative) to the total size of the
+ *    heap, and update its peak
  */
-void *mem_sbrk(int incr)
+static void mem_grow(size_t incr)
 {
-    char *old_brk = mem_brk;
+    size_t total, peak;
 
-    if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+    total = __atomic_add_fetch(&mem_total, incr, __ATOMIC_RELAXED);
+    peak = __atomic_load_n(&mem_peak, __ATOMIC_RELAXED);
+    while (total > peak &&
+           !__atomic_compare_exchange_n(&mem_peak, &peak, total, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/*
+ * mem_region_sbrk - simple model of the sbrk function for one region.
+ *    Extends the region by incr bytes and returns the start address of
+ *    the new area. A negative incr shrinks the region, giving back the
+ *    last -incr bytes, and returns the old end of the region, like sbrk.
+ *    The whole pages given back are released to the OS with madvise, so
+ *    that shrinking a region also lowers the resident size of the process.
+ */
+void *mem_region_sbrk(int region, int incr)
+{
+    region_t *r = &mem_regions[region];
+    char *old_brk = r->brk;
+
+    if ((incr < 0) && (r->brk + incr) < r->start_brk) {
+        errno = EINVAL;
+        fprintf(stderr, "ERROR: mem_sbrk failed. Shrunk below the heap...\n");
+        return (void *)-1;
+    }
+    if ((r->brk + incr) > r->max_addr) {
         errno = ENOMEM;
         fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
         return (void *)-1;
     }
-    mem_brk += incr;
+    r->brk += incr;
+    mem_grow((size_t)incr);
+
+    if (incr < 0) {
+        size_t pg = mem_pagesize();
+        char *lo = (char *)(((uintptr_t)r->brk + pg-1) & ~(uintptr_t)(pg-1));
+        char *hi = (char *)(((uintptr_t)old_brk + pg-1) & ~(uintptr_t)(pg-1));
+        if (lo < hi)
+            madvise(lo, hi - lo, MADV_DONTNEED);
+    }
     return (void *)old_brk;
 }
 
+/*
+ * mem_sbrk - mem_region_sbrk on region 0
+ */
+void *mem_sbrk(int incr)
+{
+    return mem_region_sbrk(0, incr);
+}
+
+/*
+ * mem_region_lo - return address of the first byte of a region
+ */
+void *mem_region_lo(int region)
+{
+    return (void *)mem_regions[region].start_brk;
+}
+
+/*
+ * mem_region_hi - return address of the last byte of a region
+ */
+void *mem_region_hi(int region)
+{
+    return (void *)(mem_regions[region].brk - 1);
+}
+
+/*
+ * mem_region_of - return the region whose storage holds an address, or -1
+ *    if it is in none of them
+ */
+int mem_region_of(const void *p)
+{
+    size_t off = (size_t)((const char *)p - mem_start);
+
+    if ((const char *)p < mem_start || off >= (size_t)MEM_REGIONS * MAX_HEAP)
+        return -1;
+    return (int)(off / MAX_HEAP);
+}
+
+/*
+ * mem_map - map size bytes, a multiple of the page size, outside of the
+ *    regions. Returns NULL if the mapping fails.
+ */
+void *mem_map(size_t size)
+{
+    mapping_t *m;
+    char *lo;
+
+    lo = mmap(NULL, size, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (lo == MAP_FAILED) {
+        fprintf(stderr, "ERROR: mem_map failed. Ran out of memory...\n");
+        return NULL;
+    }
+    if ((m = malloc(sizeof(mapping_t))) == NULL) {
+        munmap(lo, size);
+        return NULL;
+    }
+    m->lo = lo;
+    m->size = size;
+
+    pthread_mutex_lock(&mem_maps_lock);
+    m->next = mem_maps;
+    mem_maps = m;
+    pthread_mutex_unlock(&mem_maps_lock);
+
+    mem_grow(size);
+    return lo;
+}
+
+/*
+ * mem_unmap - give back a mapping obtained from mem_map, of the same size
+ */
+void mem_unmap(void *lo, size_t size)
+{
+    mapping_t *m, **pp;
+
+    pthread_mutex_lock(&mem_maps_lock);
+    for (pp = &mem_maps; (m = *pp) != NULL; pp = &m->next) {
+        if (m->lo == lo) {
+            *pp = m->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&mem_maps_lock);
+
+    if (m == NULL) {
+        fprintf(stderr, "ERROR: mem_unmap failed. Not a mapping...\n");
+        return;
+    }
+    munmap(m->lo, m->size);
+    mem_grow(-m->size);
+    free(m);
+}
+
+/*
+ * mem_mapped - return whether the bytes lo to hi (inclusive) all lie in a
+ *    single live mapping
+ */
+int mem_mapped(const void *lo, const void *hi)
+{
+    mapping_t *m;
+    int found = 0;
+
+    pthread_mutex_lock(&mem_maps_lock);
+    for (m = mem_maps; m != NULL; m = m->next) {
+        if ((const char *)lo >= m->lo && (const char *)hi < m->lo + m->size) {
+            found = (const char *)hi >= (const char *)lo;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&mem_maps_lock);
+    return found;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
 void *mem_heap_lo()
 {
-    return (void *)mem_start_brk;
+    return mem_region_lo(0);
 }
 
 /*
@@ -81,15 +289,25 @@ void *mem_heap_lo()
  */
 void *mem_heap_hi()
 {
-    return (void *)(mem_brk - 1);
+    return mem_region_hi(0);
 }
 
 /*
- * mem_heapsize() - returns the heap size in bytes
+ * mem_heapsize() - returns the heap size in bytes, over all regions and
+ *    mappings
  */
 size_t mem_heapsize()
 {
-    return (size_t)(mem_brk - mem_start_brk);
+    return __atomic_load_n(&mem_total, __ATOMIC_RELAXED);
+}
+
+/*
+ * mem_peak_heapsize() - returns the largest heap size in bytes since the
+ *    last reset, which is the heap size unless the heap has been shrunk
+ */
+size_t mem_peak_heapsize()
+{
+    return __atomic_load_n(&mem_peak, __ATOMIC_RELAXED);
 }
 
 /*
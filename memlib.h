@@ -1,5 +1,8 @@
 #include <unistd.h>
 
+/* number of disjoint regions of MAX_HEAP bytes in the simulated memory */
+#define MEM_REGIONS 8
+
 void mem_init(void);
 void mem_deinit(void);
 void *mem_sbrk(int incr);
@@ -7,5 +10,14 @@ void mem_reset_brk(void);
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
+size_t mem_peak_heapsize(void);
 size_t mem_pagesize(void);
 
+void *mem_region_sbrk(int region, int incr);
+void *mem_region_lo(int region);
+void *mem_region_hi(int region);
+int mem_region_of(const void *p);
+
+void *mem_map(size_t size);
+void mem_unmap(void *lo, size_t size);
+int mem_mapped(const void *lo, const void *hi);
@@ -1,62 +1,170 @@
 /*
- * mm.c - an explicit free list allocator.
+ * mm.c - a segregated free list allocator.
  *
- * This is mostly a traditional explicit free list allocator, where we keep
- * track of a linked list containing only the free blocks.
+ * This is a segregated-fit allocator: free blocks are kept in explicit doubly
+ * linked lists, one per size class ("bin"), so that a request only has to look
+ * at blocks of roughly the right size.
  *
- * Eack block is as follows:
+ * Each free block is as follows:
  * struct block {
- *     size_t header;
- *     block *prev;
- *     block *next;
+ *     word_t header;
+ *     word_t prev;
+ *     word_t next;
  *     char payload[N];
- *     size_t footer;
+ *     word_t footer;
  * }
- * where N is the size of the payload.
+ * where N is the size of the payload, and word_t is 32 bits wide whatever the
+ * ABI. The prev and next links are not pointers but offsets from the start of
+ * the simulated memory (mem_heap_lo()), which is at most MEM_REGIONS*MAX_HEAP
+ * bytes long, so a free block needs 16 bytes, the minimum block size, rather
+ * than 32 with 64-bit pointers.
  * The header and footer both contain the same data, the size of the block
- * (including both header and footer) in bytes, and the allocated flag at its
- * least-significant bit.
+ * (including both header and footer) in bytes, the allocated flag at its
+ * least-significant bit and the "previous block allocated" flag at the bit
+ * after it.
  *
- * The heap itself is 8-byte aligned, so the footer of the previous block will
- * share a double-word with the header of the following word.
+ * An allocated block only has its header, and the payload extends over the
+ * rest of the block. Only a free block needs a footer, to find its header when
+ * coalescing with the block after it, and the block after it can tell whether
+ * it is free from its own "previous block allocated" flag. This flag is kept
+ * up to date whenever a block changes between allocated and free.
+ *
+ * Payloads are 16-byte aligned, so a block header is the last word of a
+ * quad-word, and the footer of the previous block the word before it.
  *
  * The first block (the "dummy" block) and the last block (the "end" block) have
  * a slightly different structure and usage.
  *
- * The first block is structured just like a regular block, but because its
- * "prev" field will always be NULL (and is never accessed), it can be used for
- * other uses, and in this case, it was used for the "short-circuit" mechanism.
+ * The first block is larger than a regular block: after its header, the first
+ * word holds the bitmap of non-empty bins and the following NBINS words hold
+ * the heads of the free lists, one for each bin. The first block of a bin has
+ * its "prev" field pointing into the first block, two words before the head of
+ * its bin, such that prev[2] is the head itself. This way, removing a block
+ * from a list never needs to special-case the head.
  *
  * The last block is designed to mark the end of the heap (so if a heap scan
  * reaches this block, it should grow the heap to fit in the new block). It only
  * needs to have a header, of a special size 0 and marked as allocated.
  *
- * The malloc() function acts as usual in an explicit free list allocator,
- * choosing first-fit block to insert and splitting a block if and only if the
- * split size produces two blocks that are larger than the minimum size of a
- * block (which happens to be 24 bytes, the size of teh above block struct
- * rounded up to a multiple of 8).
+ * Bins are spaced four per power of two (see mm_bin), so every block in a bin
+ * is within 25% of the size of any other block in it. The last bin catches
+ * every block that is too large for the others, and is not a list but a
+ * treap (a binary search tree that is also a heap on random priorities, and
+ * thus balanced with high probability). A block in the treap uses its "prev"
+ * and "next" fields as its left and right children, and its head slot in the
+ * prologue holds the root. The blocks are ordered by size, and blocks of the
+ * same size by address, so that all keys are distinct and the best fit (the
+ * smallest large enough block, lowest address first) is found in O(log n).
+ * The priority of a block is a hash of its address, so it needs no storage.
+ *
+ * The malloc() function first looks at the bin the request falls into, where
+ * blocks may still be too small, and picks the best fit there (stopping early
+ * on a block within 25% of the request). Failing that, the first non-empty
+ * larger bin is found in constant time from the bitmap, by counting the
+ * trailing zeros of the bitmap masked to the bins above the request, and the
+ * head of that bin is taken, as any block there is large enough. Only the last
+ * bin, which has no upper bound, is searched for a best fit in its treap. A
+ * block is split if and only if the split produces two blocks that are at least
+ * the minimum size of a block (the size of the above block struct rounded up
+ * to a multiple of ALIGNMENT).
+ *
+ * The bitmap is kept up to date by mm_malloc_new_free, which sets the bit of
+ * a bin as a block is inserted, and mm_malloc_rm_free, which clears it once
+ * the last block of a bin is removed. As the cost of a failing search no
+ * longer depends on the number of free blocks, there is no need to remember
+ * which request sizes are known to fail.
+ *
+ * Small requests, of at most SLAB_MAX bytes, are served by a slab layer in
+ * front of the above once a size class has seen SLAB_THRESHOLD allocations. A
+ * "run" is an allocated block whose payload is exactly one RUN_SIZE-aligned
+ * page (relative to the start of the heap), carved into slots of one size, and
+ * with no per-slot header at all:
+ * struct run {
+ *     word_t slotsz;
+ *     word_t used;
+ *     word_t prev;
+ *     word_t next;
+ *     word_t bitmap[RUN_MAP_WORDS];
+ *     char slots[];
+ * }
+ * where a set bit in the bitmap marks a used slot. Runs with free slots are kept
+ * in one list per size class, whose heads are in the prologue after the bin
+ * heads, with the same pseudo-block trick as the bins (here prev[3] is the
+ * head). As slots have no header, a slot pointer is recognized by its address:
+ * a bitmap of the heap's pages, the slab map of the arena, marks the pages
+ * that hold a run, and the run header is at the start of the page. A run is
+ * released back to the general heap as soon as its last slot is freed.
+ *
+ * The heap is trimmed when a free leaves a free block of at least
+ * TRIM_THRESHOLD bytes at its end: all but TRIM_PAD bytes of it are given back
+ * with a negative mem_sbrk. Keeping the pad, well below the threshold, avoids
+ * shrinking and growing the heap back and forth on a workload that frees and
+ * allocates around the same size at the end of the heap. mm_exit turns
+ * trimming off, as it walks the heap while freeing its blocks.
+ *
+ * All of the above is one "arena". There are NARENAS of them, each an
+ * independent heap with its own prologue, slab map and lock, in its own region
+ * of the simulated memory (see mem_region_sbrk), so that a block's arena is
+ * known from its address alone. Threads are assigned arenas round-robin as they
+ * first call the allocator, and every arena operation is done under the lock of
+ * the arena, which is only contended by threads sharing it or freeing into it.
+ *
+ * In front of its arena, each thread has a cache of recently freed small
+ * blocks of its own arena, in singly linked lists, one per word-sized class of
+ * usable size up to TCACHE_MAX bytes and each of at most TCACHE_COUNT blocks. A
+ * cached block is still allocated as far as its arena is concerned, so mallocs
+ * and frees that hit the cache need no locking at all. The cache is given back
+ * to the arena when the thread exits, and by mm_trim and mm_exit for the
+ * calling thread. Cached blocks may hold the end of the heap, keeping it from
+ * being trimmed until then; mm_trim gives the heap a chance to shrink once the
+ * program is done with it, at the cost of refilling the cache afterwards.
  *
- * The "short-circuit" mechanism mentioned above works as follows: because the
- * slowest case in an explicit free list allocator is when a full traversal of
- * the free list is done, due to none of the blocks being large enough to fit
- * the new incoming block. In order to prevent a full traversal, we keep track
- * of the smallest block size that was unable to be allocated, and skip the heap
- * traversal in its entirety when the incoming block has a block size larger
- * than this threshold. This threshold is adjusted downwards when a small block
- * fails to be allocated using the existing heap, and is adjusted upwards when a
- * sufficiently large block is free()'d.
- * This mechanism degrades to a regular explicit free list behavior when the
- * allocations fail inside the heap in reverse size order.
+ * Behind the thread cache, coalescing is deferred: a block of at most
+ * QUICK_MAX bytes freed into its arena is not coalesced at once, but pushed on
+ * the "quick" list of its exact size, still allocated as far as the heap is
+ * concerned, and a request of that size pops it back without touching the free
+ * lists at all. There is one quick list for every block size up to QUICK_MAX,
+ * and together they hold at most QUICK_BUDGET bytes; past that, they are all
+ * freed, and their blocks coalesced, in one batch. A request that misses its
+ * quick list searches the free lists as usual, and only if that fails are the
+ * quick lists flushed and searched again, so the heap never grows while a
+ * deferred block could have served the request. They are also flushed when a
+ * block freed onto them ends the heap while the arena has enough free bytes to
+ * be trimmed, and by mm_trim, so that they do not keep the heap from shrinking.
+ *
+ * A block freed by a thread of another arena is not freed under the lock of
+ * its arena, which the owner may be holding, but pushed on the "remote" stack
+ * of the arena: a lock-free singly linked stack (a Treiber stack) on which any
+ * thread pushes with a compare and swap. The owner drains the whole stack with
+ * one atomic swap under its lock, in the next mm_malloc that finds it
+ * non-empty, or in the next mm_realloc that locks the arena, so cross-thread
+ * frees never contend with its fast path.
+ *
+ * Requests of at least MMAP_THRESHOLD bytes bypass the arenas: each gets a
+ * mapping of its own from mem_map, outside of the regions, which is given back
+ * with mem_unmap as soon as it is freed, so that a large transient buffer
+ * neither grows nor fragments an arena. Such a "huge" block has a header with
+ * the size of its mapping, and is recognized by lying in no region. Huge blocks
+ * are kept in a list, under a lock of their own, only for mm_exit.
+ *
+ * mm_init starts a new "generation": the arena and cache state of earlier
+ * generations is recognized as stale and discarded on first use, rather than
+ * having mm_init reach into every thread. Arena 0 is set up by mm_init and
+ * assigned to its caller, the others on first use.
  */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
 
 #include "mm.h"
 #include "memlib.h"
+#include "range.h"
+#include "config.h"
 
 /**********************************************************
  * NOTE TO STUDENTS: Before you do anything else, please  *
@@ -72,64 +180,440 @@ team_t team = {
 /* DON'T MODIFY THIS VALUE AND LEAVE IT AS IT WAS */
 static range_t **gl_ranges;
 
-/* single word (4) or double word (8) alignment */
-#define ALIGNMENT 8
+/* quad word (16) alignment */
+#define ALIGNMENT 16
 
 /* rounds up to the nearest multiple of ALIGNMENT */
-#define ALIGN(size) (((size) + (ALIGNMENT-1)) & ~0x7)
+#define ALIGN(size) (((size) + (ALIGNMENT-1)) & ~(ALIGNMENT-1))
+
+#define HEAD_SIZE_MASK (~0x7)
+#define HEAD_ALLOC_MASK (0x1)
+#define HEAD_PALLOC_MASK (0x2)
+#define HEAD_DATA(head) (*(word_t *)(head))
+#define HEAD_SIZE(head) (HEAD_DATA(head) & HEAD_SIZE_MASK)
+#define HEAD_ALLOC(head) (HEAD_DATA(head) & HEAD_ALLOC_MASK)
+#define HEAD_PALLOC(head) (HEAD_DATA(head) & HEAD_PALLOC_MASK)
+#define HEAD_SET(head, size, flags) (HEAD_DATA(head) = ((size) & HEAD_SIZE_MASK) | ((flags) & (HEAD_ALLOC_MASK|HEAD_PALLOC_MASK)))
+#define HEAD_SET_PALLOC(head) (HEAD_DATA(head) |= HEAD_PALLOC_MASK)
+#define HEAD_CLR_PALLOC(head) (HEAD_DATA(head) &= ~HEAD_PALLOC_MASK)
+
+/* a heap word, which holds a header, a footer or a link */
+typedef uint32_t word_t;
+
+#define WSIZE (sizeof(word_t))
+
+/*
+ * links are offsets from the start of the simulated memory (region 0), with 0
+ * for NULL, as no block starts there; PTR evaluates its argument twice
+ */
+static char *mm_base;
+
+#define OFF(ptr) ((word_t)((char *)(ptr) - mm_base))
+#define PTR(off) ((off) ? (word_t *)(mm_base + (off)) : NULL)
+
+/* the prologue header of an arena, padded so that payloads are aligned */
+#define ARENA_BASE(id) ((word_t *)((char *)mem_region_lo(id) + ALIGNMENT) - 1)
+
+/* the epilogue header of an arena */
+#define ARENA_END(a) ((word_t *)((char *)mem_region_hi((a)->id)+1) - 1)
+
+/* smallest block: header, prev, next and footer */
+#define MIN_BLOCK (ALIGN(4*WSIZE))
+
+/*
+ * number of bins (at most the number of bits in the bitmap), and number of
+ * slab size classes
+ */
+#define NBINS 32
+#define NSLABS (SLAB_MAX/ALIGNMENT)
+
+_Static_assert(NBINS == MM_STATS_BINS, "mm_stats_t has a counter per bin");
+
+/*
+ * the prologue block: header, bitmap, bin heads, slab run list heads and slab
+ * class allocation counters, rounded up to a multiple of ALIGNMENT
+ */
+#define SLAB_HEAD(c) (2+NBINS+(c))
+#define SLAB_COUNT(c) (2+NBINS+NSLABS+(c))
+#define PRO_SIZE (ALIGN((2+NBINS+2*NSLABS)*WSIZE))
+
+/* the last bin, kept as a treap rather than a list */
+#define TREE_BIN (NBINS-1)
+
+/*
+ * largest request served by slabs, number of allocations of a class before it
+ * is served by slabs, and size of the payload of a run
+ */
+#define SLAB_MAX 64
+#define SLAB_THRESHOLD 32
+#define RUN_SIZE 4096
+
+/* run header: slot size, used count, prev, next and the slot bitmap */
+#define RUN_MAP_WORDS (RUN_SIZE/ALIGNMENT/(8*WSIZE))
+#define RUN_HDR (ALIGN((4+RUN_MAP_WORDS)*WSIZE))
+
+/* size of a run block, and of a free block that is sure to contain one */
+#define RUN_BLOCK (ALIGN(RUN_SIZE+WSIZE))
+#define RUN_FIT (RUN_SIZE+MIN_BLOCK+RUN_BLOCK)
+
+/*
+ * a trailing free block of at least TRIM_THRESHOLD bytes is trimmed down to
+ * TRIM_PAD bytes; both can be overridden at compile time
+ */
+#ifndef TRIM_THRESHOLD
+#define TRIM_THRESHOLD (256*1024)
+#endif
+#ifndef TRIM_PAD
+#define TRIM_PAD (64*1024)
+#endif
+
+/*
+ * largest request served by the thread cache, and number of blocks the cache
+ * holds at most for each size class; classes are one word apart, and are
+ * tracked in a bitmap
+ */
+#define TCACHE_MAX 128
+#define TCACHE_COUNT 8
+#define TCACHE_CLASSES (TCACHE_MAX/WSIZE)
+
+/*
+ * blocks of at most QUICK_MAX bytes are freed onto the quick lists, one per
+ * block size, until these hold more than QUICK_BUDGET bytes; both can be
+ * overridden at compile time, and a QUICK_BUDGET of 0 coalesces every free at
+ * once
+ */
+#ifndef QUICK_MAX
+#define QUICK_MAX 1024
+#endif
+#ifndef QUICK_BUDGET
+#define QUICK_BUDGET (4*1024)
+#endif
+#define QUICK_CLASSES (QUICK_MAX/ALIGNMENT)
+
+_Static_assert(QUICK_CLASSES <= 64, "quick lists are tracked in a bitmap");
+
+/* marks the blocks on the quick lists of an arena */
+#define QUICK_MARK(a) OFF((a)->quick)
+
+/*
+ * requests of at least MMAP_THRESHOLD bytes get a mapping of their own, which
+ * can be overridden at compile time
+ */
+#ifndef MMAP_THRESHOLD
+#define MMAP_THRESHOLD (1024*1024)
+#endif
+
+/*
+ * a debug build (-DMM_DEBUG) checks the whole heap with mm_check as every call
+ * of the interface starts, and aborts on the first inconsistency
+ */
+#ifdef MM_DEBUG
+#define MM_DEBUG_CHECK() do { if (!mm_check()) abort(); } while (0)
+#else
+#define MM_DEBUG_CHECK()
+#endif
+
+/* header of a huge block: prev, next and size of the mapping */
+#define HUGE_HDR (ALIGN(3*sizeof(size_t)))
+
+/* one arena for each region of the simulated memory */
+#define NARENAS MEM_REGIONS
+
+/* an arena: an independent heap in its own region */
+typedef struct {
+    int lock;                /* spinlock, see mm_lock */
+    int id;                  /* region of the arena */
+    unsigned int gen;        /* mm_init generation the heap was set up in */
+    char *lo;                /* first byte of the region */
+    word_t *heap;            /* prologue header */
+    int no_trim;             /* set by mm_exit while it walks the heap */
+    word_t quick[QUICK_CLASSES];  /* quick lists, by block size */
+    uint64_t quick_map;      /* bitmap of non-empty quick lists */
+    size_t quick_bytes;      /* bytes in blocks on the quick lists */
+    unsigned char slab_map[MAX_HEAP/RUN_SIZE/8];  /* pages that hold a run */
+    mm_stats_t stats __attribute__((aligned(64))); /* counted under the lock */
+    word_t remote __attribute__((aligned(64)));   /* blocks freed by others */
+} arena_t;
+
+/* the per-thread cache of freed small blocks */
+typedef struct {
+    unsigned int gen;        /* mm_init generation the cache belongs to */
+    int arena;               /* arena of the thread */
+    word_t key;              /* marks the blocks of this cache */
+    unsigned int map;        /* bitmap of non-empty classes */
+    word_t head[TCACHE_CLASSES];
+    unsigned char count[TCACHE_CLASSES];
+    mm_stats_t stats;        /* counts of the paths that take no lock */
+} tcache_t;
+
+static arena_t mm_arenas[NARENAS];
+static unsigned int mm_gen;          /* bumped by every mm_init */
+static unsigned int mm_next_arena;   /* arena of the next new thread */
+static pthread_once_t mm_once = PTHREAD_ONCE_INIT;
+static pthread_key_t mm_key;         /* flushes the cache on thread exit */
+static __thread tcache_t mm_tcache;
+static size_t *mm_huge;              /* list of huge blocks */
+static int mm_huge_lock;
+
+static void mm_thread_exit(void *p);
+
+#define SLAB_PAGE(a, ptr) (((char *)(ptr) - (a)->lo) / RUN_SIZE)
+#define SLAB_IS_RUN(a, ptr) ((a)->slab_map[SLAB_PAGE(a, ptr)/8] & (1 << SLAB_PAGE(a, ptr)%8))
+#define SLAB_RUN(a, ptr) ((word_t *)((a)->lo + SLAB_PAGE(a, ptr)*RUN_SIZE))
+
+/*
+ * mm_bin - size class of a block size.
+ * Bins are spaced four per power of two, starting from 16 bytes, with the last
+ * bin collecting all blocks that are too large for the others.
+ */
+static int mm_bin(size_t size)
+{
+    int lg = 8*sizeof(unsigned int) - 1 - __builtin_clz((unsigned int)size);
+    int bin = (lg-4)*4 + ((size >> (lg-2)) & 3);
+    return bin < NBINS ? bin : NBINS-1;
+}
+
+/*
+ * mm_tree_less - order of blocks in the treap, by size and then by address.
+ */
+static int mm_tree_less(word_t *a, word_t *b)
+{
+    return HEAD_SIZE(a) < HEAD_SIZE(b) ||
+        (HEAD_SIZE(a) == HEAD_SIZE(b) && a < b);
+}
 
-#define SIZE_T_SIZE (ALIGN(sizeof(size_t)))
+/*
+ * mm_tree_prio - treap priority of a block, a multiplicative hash of its
+ * address.
+ */
+static unsigned int mm_tree_prio(word_t *block)
+{
+    return (unsigned int)(OFF(block) / ALIGNMENT) * 2654435761u;
+}
 
 /*
- * remove_range - manipulate range lists
- * DON'T MODIFY THIS FUNCTION AND LEAVE IT AS IT WAS
+ * mm_tree_insert - insert a block into the treap rooted at *link.
+ * The block is inserted as a leaf, and rotated up on the way back as long as
+ * its priority is higher than its parent's.
  */
-static void remove_range(range_t **ranges, char *lo)
+static void mm_tree_insert(word_t *link, word_t *block)
 {
-    range_t *p;
-    range_t **prevpp = ranges;
+    word_t *root = PTR(*link), *child;
 
-    if (!ranges)
-      return;
+    if (root == NULL) {
+        block[1] = block[2] = 0;
+        *link = OFF(block);
+        return;
+    }
 
-    for (p = *ranges;  p != NULL; p = p->next) {
-      if (p->lo == lo) {
-        *prevpp = p->next;
-        free(p);
-        break;
-      }
-      prevpp = &(p->next);
+    if (mm_tree_less(block, root)) {
+        mm_tree_insert(&root[1], block);
+        child = PTR(root[1]);
+        if (mm_tree_prio(child) > mm_tree_prio(root)) {
+            // rotate right
+            root[1] = child[2];
+            child[2] = OFF(root);
+            *link = OFF(child);
+        }
+    } else {
+        mm_tree_insert(&root[2], block);
+        child = PTR(root[2]);
+        if (mm_tree_prio(child) > mm_tree_prio(root)) {
+            // rotate left
+            root[2] = child[1];
+            child[1] = OFF(root);
+            *link = OFF(child);
+        }
     }
 }
 
-#define HEAD_SIZE_MASK (~0x7)
-#define HEAD_ALLOC_MASK (0x1)
-#define HEAD_DATA(head) (*(size_t *)(head))
-#define HEAD_SIZE(head) (HEAD_DATA(head) & HEAD_SIZE_MASK)
-#define HEAD_ALLOC(head) (HEAD_DATA(head) & HEAD_ALLOC_MASK)
-#define HEAD_SET(head, size, alloc) (HEAD_DATA(head) = (size & HEAD_SIZE_MASK) | (alloc & HEAD_ALLOC_MASK))
+/*
+ * mm_tree_remove - remove a block from the treap rooted at *link.
+ * The link pointing to the block is found by searching for its key, and the
+ * block is then rotated down, towards its child of higher priority, until it
+ * has at most one child, which takes its place.
+ */
+static void mm_tree_remove(word_t *link, word_t *block)
+{
+    word_t *cur;
+
+    while ((cur = PTR(*link)) != block)
+        link = mm_tree_less(block, cur) ? &cur[1] : &cur[2];
+
+    while (block[1] && block[2]) {
+        word_t *left = PTR(block[1]), *right = PTR(block[2]);
+        if (mm_tree_prio(left) > mm_tree_prio(right)) {
+            block[1] = left[2];
+            left[2] = OFF(block);
+            *link = OFF(left);
+            link = &left[2];
+        } else {
+            block[2] = right[1];
+            right[1] = OFF(block);
+            *link = OFF(right);
+            link = &right[1];
+        }
+    }
+    *link = block[1] ? block[1] : block[2];
+}
+
+/*
+ * mm_tree_fit - find the best fit for reqsz in the treap rooted at root.
+ * Returns the smallest block that is at least reqsz bytes long, or NULL.
+ */
+static word_t *mm_tree_fit(word_t *root, size_t reqsz)
+{
+    word_t *best = NULL;
+
+    while (root != NULL) {
+        if (HEAD_SIZE(root) >= reqsz) {
+            best = root;
+            root = PTR(root[1]);
+        } else {
+            root = PTR(root[2]);
+        }
+    }
+    return best;
+}
+
+/*
+ * mm_arena_setup - set up an empty heap in the region of an arena.
+ * The heap starts with a dummy prologue and ends with a dummy epilogue. The
+ * prologue is a block of PRO_SIZE bytes, that holds the bitmap of non-empty
+ * bins in the "prev" field ([1]), the heads of the NBINS free lists right after
+ * it ([2] onwards), and then the heads of the run lists and the allocation
+ * counters of the NSLABS slab classes. The epilogue holds a dummy "allocated"
+ * block of size 0, to mark the end of the heap. Whatever the region held from
+ * an earlier generation is given back first.
+ */
+static int mm_arena_setup(int id)
+{
+    arena_t *a = &mm_arenas[id];
+    size_t used = (char *)mem_region_hi(id)+1 - (char *)mem_region_lo(id);
+
+    if (used && mem_region_sbrk(id, -(int)used) == (void *)-1)
+        return -1;
+
+    // Initialize heap, the first word is padding for alignment
+    if (mem_region_sbrk(id, PRO_SIZE + ALIGNMENT) == (void *)-1)
+        return -1;
+    a->id = id;
+    a->lo = mem_region_lo(id);
+    a->heap = ARENA_BASE(id);
+
+    HEAD_SET(a->heap, PRO_SIZE, HEAD_ALLOC_MASK|HEAD_PALLOC_MASK);
+    memset(&a->heap[1], 0, PRO_SIZE-WSIZE);
+    memset(a->slab_map, 0, sizeof(a->slab_map));
+    HEAD_SET(&a->heap[PRO_SIZE/WSIZE], 0, HEAD_ALLOC_MASK|HEAD_PALLOC_MASK);
+    memset(a->quick, 0, sizeof(a->quick));
+    a->quick_map = 0;
+    a->quick_bytes = 0;
+    a->no_trim = 0;
+    a->remote = 0;
+    memset(&a->stats, 0, sizeof(a->stats));
+
+    a->gen = mm_gen;
+    return 0;
+}
+
+/*
+ * mm_once_init - one-time setup of the thread exit hook.
+ */
+static void mm_once_init(void)
+{
+    pthread_key_create(&mm_key, mm_thread_exit);
+}
+
+/*
+ * mm_thread - the cache of the calling thread.
+ * A thread whose cache is from an earlier generation (or that never called the
+ * allocator) starts over with an empty cache, and is assigned the next arena
+ * round-robin.
+ */
+static tcache_t *mm_thread(void)
+{
+    tcache_t *t = &mm_tcache;
+    unsigned int gen = __atomic_load_n(&mm_gen, __ATOMIC_ACQUIRE);
+
+    if (t->gen != gen) {
+        memset(t, 0, sizeof(*t));
+        t->gen = gen;
+        t->key = (word_t)(uintptr_t)t;
+        t->arena = __atomic_fetch_add(&mm_next_arena, 1, __ATOMIC_RELAXED)
+            % NARENAS;
+        pthread_setspecific(mm_key, t);
+    }
+    return t;
+}
+
+/*
+ * mm_spin_lock - take a lock.
+ * Locks are test-and-set spinlocks, as they are held only for the length of
+ * one allocator operation, and cheaper than a mutex when uncontended. A waiter
+ * spins on plain loads, and yields the processor after a while.
+ */
+static void mm_spin_lock(int *lock)
+{
+    int spins = 0;
+
+    while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(lock, __ATOMIC_RELAXED)) {
+            if (++spins == 64) {
+                spins = 0;
+                sched_yield();
+            }
+        }
+    }
+}
+
+/*
+ * mm_spin_unlock - release a lock.
+ */
+static void mm_spin_unlock(int *lock)
+{
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * mm_unlock - unlock an arena.
+ */
+static void mm_unlock(arena_t *a)
+{
+    mm_spin_unlock(&a->lock);
+}
+
+/*
+ * mm_lock - lock an arena, setting up its heap on first use in a generation.
+ * Returns NULL if the heap could not be set up, with the arena unlocked.
+ */
+static arena_t *mm_lock(arena_t *a)
+{
+    mm_spin_lock(&a->lock);
+    if (a->gen != __atomic_load_n(&mm_gen, __ATOMIC_ACQUIRE) &&
+            mm_arena_setup(a - mm_arenas) < 0) {
+        mm_unlock(a);
+        return NULL;
+    }
+    return a;
+}
 
 /*
  *  mm_init - initialize the malloc package.
- *  it initializes the heap with a dummy prologue and epilogue. The prologue
- *  is a block that seems to be 24 bytes long, that holds the short-circuit
- *  threshold in the "prev" field ([1]) and the beginning of the free list in
- *  the "next" field ([2]). The prologue holds a dummy "allocated" block of zie
- *  0, to mark the end of the heap.
+ *  Starts a new generation, which discards every arena and thread cache of the
+ *  previous one, sets up arena 0 and assigns it to the calling thread. The other
+ *  arenas are set up once a thread assigned to them first locks them.
  */
 int mm_init(range_t **ranges)
 {
-    // Initialize heap
-    size_t *heap = mem_sbrk(3*SIZE_T_SIZE);
-    if (heap == (void *) -1)
-        return -1;
-    heap++;
+    pthread_once(&mm_once, mm_once_init);
+    mm_base = mem_heap_lo();
 
-    HEAD_SET(heap, 2*SIZE_T_SIZE, 1);
-    heap[1] = 0;
-    heap[2] = NULL;
-    HEAD_SET(&heap[3], 2*SIZE_T_SIZE, 1);
-    HEAD_SET(&heap[4], 0, 1);
+    __atomic_add_fetch(&mm_gen, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&mm_next_arena, 0, __ATOMIC_RELAXED);
+    if (mm_arena_setup(0) < 0)
+        return -1;
+    mm_thread();
+    mm_huge = NULL;
 
     /* DON'T MODIFY THIS STAGE AND LEAVE IT AS IT WAS */
     gl_ranges = ranges;
@@ -139,229 +623,1544 @@ int mm_init(range_t **ranges)
 
 /*
  * mm_malloc_new_free - add a new free block to the free list.
- * This inserts the new block at the beginning of the free list, by setting its
- * "prev" field to the first block in the heap and the "next" node to the former
- * first block. It also updates the former first block's "next" field if it
- * if it exists.
+ * This inserts the new block at the beginning of the list of its bin, by
+ * setting its "prev" field to the pseudo-block in the prologue whose "next"
+ * field is the head of the bin, and the "next" node to the former first block.
+ * It also updates the former first block's "prev" field if it exists, or marks
+ * the bin as non-empty otherwise. Large blocks are inserted into the treap.
  */
-static void mm_malloc_new_free(size_t *heap, size_t *block) {
-    if (heap[2] != NULL) {
-        size_t *first = (size_t *)heap[2];
-        first[1] = block;
+static void mm_malloc_new_free(arena_t *a, word_t *block) {
+    word_t *heap = a->heap;
+    int bin = mm_bin(HEAD_SIZE(block));
+
+    a->stats.free_bytes += HEAD_SIZE(block);
+    a->stats.free_blocks[bin]++;
+
+    if (bin == TREE_BIN) {
+        heap[1] |= 1u << bin;
+        mm_tree_insert(&heap[2+bin], block);
+        return;
+    }
+
+    if (heap[2+bin]) {
+        word_t *first = PTR(heap[2+bin]);
+        first[1] = OFF(block);
+    } else {
+        heap[1] |= 1u << bin;
     }
-    block[1] = heap;
-    block[2] = heap[2];
-    heap[2] = block;
+    block[1] = OFF(&heap[bin]);
+    block[2] = heap[2+bin];
+    heap[2+bin] = OFF(block);
 }
 
 /*
  * mm_malloc_rm_free - remove a block from the free list.
  * Removes the block by setting the "next" field of the block before this (which
- * is guaranteed to never be null) to its own "next", and vice versa.
+ * is guaranteed to never be null) to its own "next", and vice versa. If the
+ * block was the only one in its bin, the bin is marked as empty. Large blocks
+ * are removed from the treap instead.
  */
-static void mm_malloc_rm_free(size_t *block) {
+static void mm_malloc_rm_free(arena_t *a, word_t *block) {
+    word_t *heap = a->heap;
+    int bin = mm_bin(HEAD_SIZE(block));
+
+    a->stats.free_bytes -= HEAD_SIZE(block);
+    a->stats.free_blocks[bin]--;
+    if (bin == TREE_BIN) {
+        mm_tree_remove(&heap[2+TREE_BIN], block);
+        if (!heap[2+TREE_BIN])
+            heap[1] &= ~(1u << TREE_BIN);
+        return;
+    }
+
     // prev is never null
-    size_t *prev = (size_t *)block[1];
+    word_t *prev = PTR(block[1]);
     prev[2] = block[2];
 
-    if (block[2] != NULL) {
-        size_t *next = (size_t *)block[2];
+    if (block[2]) {
+        word_t *next = PTR(block[2]);
         next[1] = block[1];
+    } else if (prev < &heap[NBINS]) {
+        // prev is the pseudo-block of the bin, which is now empty
+        heap[1] &= ~(1u << (prev-heap));
     }
 }
 
 /*
- * mm_malloc_new - allocate a brand-new portion of the heap.
- * Allocates a new portion of the heap, obtained through a call to mem_sbrk().
- * It then updates the former epilogue to be the new header, and adds a footer
- * as well as the new epilogue. As special case, if the difference between
- * the payload size rounded up to the nearest power of two is small, the size is
- * rounded up to the power of two.
+ * mm_round - round a block size up to the next power of two (plus the
+ * alignment of the header), if that wastes less than a quarter of the result.
  */
-static void *mm_malloc_new(size_t reqsz) {
-    // if not a multiple of two, try rounding to a near power of two
-    size_t rnd = reqsz - 2*SIZE_T_SIZE - 1;
+static size_t mm_round(size_t reqsz)
+{
+    size_t rnd = reqsz - ALIGNMENT - 1;
     rnd |= rnd>>1;
     rnd |= rnd>>2;
     rnd |= rnd>>4;
     rnd |= rnd>>8;
     rnd |= rnd>>16;
-    rnd += 2*SIZE_T_SIZE + 1;
-    if (rnd-reqsz < rnd/4)
-        reqsz = rnd;
+    rnd += ALIGNMENT + 1;
+    return (rnd-reqsz < rnd/4) ? rnd : reqsz;
+}
 
-    size_t *heap_bot = (size_t *)((char *)mem_heap_hi()+1) - 2;
-    if (!HEAD_ALLOC(heap_bot)) {
-        // last block is free, extend it
-        size_t cursz = HEAD_SIZE(heap_bot);
-        size_t *cur_head = &heap_bot[-cursz/sizeof(size_t)+1];
+/*
+ * mm_malloc_new - allocate a brand-new portion of the heap.
+ * Allocates a new portion of the heap, obtained through a call to
+ * mem_region_sbrk() on the region of the arena.
+ * It then updates the former epilogue to be the new header, and adds the new
+ * epilogue. As special case, if the difference between
+ * the payload size rounded up to the nearest power of two is small, the size is
+ * rounded up to the power of two (see mm_round).
+ */
+static void *mm_malloc_new(arena_t *a, size_t reqsz) {
+    // if not a multiple of two, try rounding to a near power of two
+    reqsz = mm_round(reqsz);
 
-        mm_malloc_rm_free(cur_head);
+    word_t *heap_end = ARENA_END(a);
+    if (!HEAD_PALLOC(heap_end)) {
+        // last block is free, extend it
+        size_t cursz = HEAD_SIZE(&heap_end[-1]);
+        word_t *cur_head = &heap_end[-cursz/WSIZE];
 
-        void *mem = mem_sbrk(reqsz-cursz);
+        a->stats.sbrks++;
+        void *mem = mem_region_sbrk(a->id, reqsz-cursz);
         if (mem == (void *)-1)
             return NULL;
 
-        HEAD_SET(cur_head, reqsz, 1);
-        HEAD_SET(&cur_head[reqsz/sizeof(size_t)-1], reqsz, 1);
-        HEAD_SET(&cur_head[reqsz/sizeof(size_t)], 0, 1);
+        mm_malloc_rm_free(a, cur_head);
+
+        HEAD_SET(cur_head, reqsz, HEAD_ALLOC_MASK|HEAD_PALLOC_MASK);
+        HEAD_SET(&cur_head[reqsz/WSIZE], 0, HEAD_ALLOC_MASK|HEAD_PALLOC_MASK);
 
         return (void *)&cur_head[1];
     }
 
-    size_t *new_area = mem_sbrk(reqsz);
+    a->stats.sbrks++;
+    word_t *new_area = mem_region_sbrk(a->id, reqsz);
     if (new_area == (void *)-1)
         return NULL;
 
     // cur block header
-    HEAD_SET(&new_area[-1], reqsz, 1);
-    // cur block footer
-    HEAD_SET(&new_area[reqsz/sizeof(size_t)-2], reqsz, 1);
+    HEAD_SET(&new_area[-1], reqsz, HEAD_ALLOC_MASK|HEAD_PALLOC_MASK);
     // next block header
-    HEAD_SET(&new_area[reqsz/sizeof(size_t)-1], 0, 1);
+    HEAD_SET(&new_area[reqsz/WSIZE-1], 0, HEAD_ALLOC_MASK|HEAD_PALLOC_MASK);
 
     return (void *)new_area;
 }
 
 /*
- * mm_malloc - allocate a block.
- * First check the short-circuit threshold, and allocate a new block with
- * mm_malloc_new if this block cannot be inserted in the current heap.
- * Otherwise, traverse the free list to see if there is any block where we can
- * insert this new block, and insert it as needed. If this block could not be
- * inserted, adjust the threshold downwards (as appropriate) and use
- * mm_malloc_new.
+ * mm_free_block - return a block to the free lists.
+ * First adjust the free beginning and end by coalescing with its neighboring
+ * blocks, then adjusts the free list as appropriate. Whether the previous block
+ * is free is known from the "previous block allocated" flag, and only then is
+ * its footer read. If the free block ends up large and at the end of the heap,
+ * the heap is trimmed, unless trimming is turned off for the arena.
  */
-void *mm_malloc(size_t size)
+static void mm_free_block(arena_t *a, word_t *block)
 {
-    if (size == 0)
-        return NULL;
+    word_t *start = block, *end = &block[HEAD_SIZE(block)/WSIZE];
 
-    size_t reqsz = ALIGN(size) + SIZE_T_SIZE;
-    size_t *heap = mem_heap_lo();
-    heap++;
-
-    // short-circuit large blocks
-    if (heap[1] && reqsz >= heap[1])
-        return mm_malloc_new(reqsz);
-
-    // scan free list, first fit
-    size_t *cur_head = (size_t *)heap[2], cursz;
-    size_t *best_head = NULL, bestsz;
-    while (cur_head != NULL) {
-        if (!HEAD_ALLOC(cur_head) && (cursz = HEAD_SIZE(cur_head)) >= reqsz) {
-            if (cursz-reqsz <= reqsz/4) {
-                best_head = cur_head;
-                bestsz = cursz;
-                break;
-            } else if (best_head == NULL || cursz < bestsz) {
-                best_head = cur_head;
-                bestsz = cursz;
-            }
+    if (!HEAD_PALLOC(start)) {
+        start -= HEAD_SIZE(&start[-1])/WSIZE;
+        mm_malloc_rm_free(a, start);
+        a->stats.coalesces++;
+    }
+
+    if (!HEAD_ALLOC(end)) {
+        mm_malloc_rm_free(a, end);
+        end += HEAD_SIZE(end)/WSIZE;
+        a->stats.coalesces++;
+    }
+
+    size_t freesz = (end-start)*WSIZE;
+    if (HEAD_SIZE(end) == 0 && freesz >= TRIM_THRESHOLD && !a->no_trim) {
+        a->stats.sbrks++;
+        if (mem_region_sbrk(a->id, -(int)(freesz-TRIM_PAD)) != (void *)-1) {
+            a->stats.trims++;
+            freesz = TRIM_PAD;
+            end = &start[freesz/WSIZE];
+            HEAD_SET(end, 0, HEAD_ALLOC_MASK);
         }
-        cur_head = (size_t *)cur_head[2];
     }
 
-    cur_head = best_head;
-    cursz = bestsz;
+    HEAD_SET(start, freesz, HEAD_PALLOC_MASK);
+    HEAD_SET(end-1, freesz, HEAD_PALLOC_MASK);
+    HEAD_CLR_PALLOC(end);
 
-    // no appropriate block found
-    if (cur_head == NULL) {
-        // update short-circuit
-        if (!heap[1] || heap[1] > reqsz)
-            heap[1] = reqsz;
-        return mm_malloc_new(reqsz);
+    mm_malloc_new_free(a, start);
+}
+
+/*
+ * mm_arena_trim - trim the heap of a locked arena if it ends in a free block
+ * large enough, as a free that left it there would have. This catches the
+ * end of the heap freed while trimming could not be done, or only reached by
+ * freeing a batch of cached blocks.
+ */
+static void mm_arena_trim(arena_t *a)
+{
+    word_t *end = ARENA_END(a), *last;
+
+    if (HEAD_PALLOC(end))
+        return;
+    last = end - HEAD_SIZE(&end[-1])/WSIZE;
+    if (HEAD_SIZE(last) >= TRIM_THRESHOLD) {
+        mm_malloc_rm_free(a, last);
+        mm_free_block(a, last);
     }
-    // else, reuse existing block at cur_head
+}
 
-    // remove from free list
-    mm_malloc_rm_free(cur_head);
+/*
+ * mm_quick_flush - free every block on the quick lists of an arena in one
+ * batch, coalescing them with their neighbors, and so with each other. Only
+ * the non-empty lists are visited, found through the bitmap.
+ */
+static void mm_quick_flush(arena_t *a)
+{
+    word_t *block;
+    int c;
 
-    // splitting logic, only split if the other part is large enough
-    if (cursz - reqsz >= 16) {
-        size_t restsz = cursz - reqsz;
+    if (a->quick_map == 0)
+        return;
+    do {
+        c = __builtin_ctzll(a->quick_map);
+        a->quick_map &= a->quick_map - 1;
+        while ((block = PTR(a->quick[c])) != NULL) {
+            a->quick[c] = block[1];
+            block[2] = 0;
+            mm_free_block(a, block);
+        }
+    } while (a->quick_map);
+    a->quick_bytes = 0;
+    a->stats.quick_flushes++;
+}
+
+/*
+ * mm_quick_put - defer freeing a block onto the quick list of its size.
+ * The block stays allocated, links to the next one in its first payload word
+ * and holds the mark of the quick lists in its second, so that freeing it again
+ * is caught (confirmed by a scan of its list) instead of listing it twice. The
+ * lists are flushed once they hold more than QUICK_BUDGET bytes, and when the
+ * block is at the end of the heap while the arena holds enough free bytes to be
+ * trimmed, as the quick blocks may be all that keeps the free space below them
+ * from reaching the end. Returns 0 if the block is too large for them (or for
+ * the budget).
+ */
+static int mm_quick_put(arena_t *a, word_t *block)
+{
+    size_t size = HEAD_SIZE(block);
+    word_t *next = &block[size/WSIZE], *q;
+    int c, top;
 
-        HEAD_SET(&cur_head[reqsz/sizeof(size_t)], restsz, 0);
-        HEAD_SET(&cur_head[cursz/sizeof(size_t)-1], restsz, 0);
+    if (QUICK_BUDGET == 0 || size > QUICK_MAX || size > QUICK_BUDGET)
+        return 0;
+    c = size/ALIGNMENT - 1;
 
-        mm_malloc_new_free(heap, &cur_head[reqsz/sizeof(size_t)]);
-        cursz = reqsz;
+    if (block[2] == QUICK_MARK(a)) {
+        // error on double-free
+        for (q = PTR(a->quick[c]); q != NULL; q = PTR(q[1])) {
+            if (q == block) {
+                fprintf(stderr, "double-free detected\n");
+                exit(1);
+            }
+        }
     }
 
-    // set cur header
-    HEAD_SET(cur_head, cursz, 1);
-    // set cur footer
-    HEAD_SET(&cur_head[cursz/sizeof(size_t)-1], cursz, 1);
+    // the block is the last one, or only a free block follows it
+    top = HEAD_SIZE(next) == 0 ||
+        (!HEAD_ALLOC(next) && HEAD_SIZE(&next[HEAD_SIZE(next)/WSIZE]) == 0);
 
-    return (void *)&cur_head[1];
+    block[1] = a->quick[c];
+    block[2] = QUICK_MARK(a);
+    a->quick[c] = OFF(block);
+    a->quick_map |= 1ull << c;
+    a->quick_bytes += size;
+    a->stats.quick_puts++;
+    if (a->quick_bytes > QUICK_BUDGET ||
+            (top && a->stats.free_bytes >= TRIM_THRESHOLD && !a->no_trim))
+        mm_quick_flush(a);
+    return 1;
 }
 
 /*
- * mm_free - free a block.
- * First adjust the free beginning and end by coalescing with its neighboring
- * blocks, then adjusts the free list as appropriate. We also upwardly adjust
- * the short-circuit threshold if needed.
+ * mm_slab_link - add a run to the list of runs with free slots of its class.
  */
-void mm_free(void *ptr)
+static void mm_slab_link(word_t *heap, word_t *run)
 {
-    size_t *block = ((size_t *)ptr)-1;
+    int c = run[0]/ALIGNMENT - 1;
 
-    // error on double-free
-    if (!HEAD_ALLOC(block)) {
-        fprintf(stderr, "double-free detected\n");
-        exit(1);
+    if (heap[SLAB_HEAD(c)]) {
+        word_t *first = PTR(heap[SLAB_HEAD(c)]);
+        first[2] = OFF(run);
     }
+    run[2] = OFF(&heap[SLAB_HEAD(c)-3]);
+    run[3] = heap[SLAB_HEAD(c)];
+    heap[SLAB_HEAD(c)] = OFF(run);
+}
 
-    size_t *start = block, *end = &block[HEAD_SIZE(block)/sizeof(size_t)];
+/*
+ * mm_slab_unlink - remove a run from the list of runs with free slots.
+ */
+static void mm_slab_unlink(word_t *run)
+{
+    word_t *prev = PTR(run[2]);
+    prev[3] = run[3];
 
-    if (!HEAD_ALLOC(&start[-1])) {
-        start -= HEAD_SIZE(&start[-1])/sizeof(size_t);
-        mm_malloc_rm_free(start);
+    if (run[3]) {
+        word_t *next = PTR(run[3]);
+        next[2] = run[2];
     }
+}
 
-    if (!HEAD_ALLOC(end)) {
-        mm_malloc_rm_free(end);
-        end += HEAD_SIZE(end)/sizeof(size_t);
+/*
+ * mm_slab_align - find where a run can be placed in a free region.
+ * Returns the first RUN_SIZE-aligned payload address in the region starting at
+ * the header start, such that the space left before its header is either empty
+ * or large enough to be a free block of its own.
+ */
+static word_t *mm_slab_align(arena_t *a, word_t *start)
+{
+    size_t off = (char *)&start[1] - a->lo;
+    size_t lead = -off & (RUN_SIZE-1);
+
+    if (lead != 0 && lead < MIN_BLOCK)
+        lead += RUN_SIZE;
+    return &start[1+lead/WSIZE];
+}
+
+/*
+ * mm_slab_place - place a run in a free region.
+ * The region of size bytes starting at start, which is not on any free list,
+ * is split into a free block before the run (if any), the run block, and a free
+ * block after the run (if large enough, otherwise it stays in the run block).
+ * Returns the payload of the run block.
+ */
+static word_t *mm_slab_place(arena_t *a, word_t *start, size_t size)
+{
+    word_t *run = mm_slab_align(a, start), *block = run-1;
+    size_t lead = (block-start)*WSIZE, runsz = size-lead;
+
+    if (lead) {
+        HEAD_SET(start, lead, HEAD_PALLOC_MASK);
+        HEAD_SET(block-1, lead, HEAD_PALLOC_MASK);
+        mm_malloc_new_free(a, start);
     }
 
-    size_t freesz = (end-start)*sizeof(size_t);
-    HEAD_SET(start, freesz, 0);
-    HEAD_SET(end-1, freesz, 0);
+    if (runsz - RUN_BLOCK >= MIN_BLOCK) {
+        size_t restsz = runsz - RUN_BLOCK;
+
+        HEAD_SET(&block[RUN_BLOCK/WSIZE], restsz, HEAD_PALLOC_MASK);
+        HEAD_SET(&block[runsz/WSIZE-1], restsz, HEAD_PALLOC_MASK);
+        mm_malloc_new_free(a, &block[RUN_BLOCK/WSIZE]);
+        runsz = RUN_BLOCK;
+    } else {
+        HEAD_SET_PALLOC(&block[runsz/WSIZE]);
+    }
 
-    size_t *heap = mem_heap_lo();
-    heap++;
+    HEAD_SET(block, runsz, HEAD_ALLOC_MASK | (lead ? 0 : HEAD_PALLOC_MASK));
+    return run;
+}
 
-    mm_malloc_new_free(heap, start);
-    // update short-circuit upper bound if needed
-    if (heap[1] && heap[1] < freesz+1)
-        heap[1] = freesz+1;
+/*
+ * mm_slab_new - allocate a new run for slots of slotsz bytes.
+ * The run is placed in a large enough free block from the treap if there is
+ * one, flushing the quick lists to find one if need be, or else at the end of
+ * the heap, which is extended (together with the last block, if it is free) as
+ * needed. The new run is empty, and is added to the list of its class.
+ */
+static word_t *mm_slab_new(arena_t *a, size_t slotsz)
+{
+    word_t *heap = a->heap;
+    word_t *start = mm_tree_fit(PTR(heap[2+TREE_BIN]), RUN_FIT);
+    size_t size;
 
-    /* DON'T MODIFY THIS STAGE AND LEAVE IT AS IT WAS */
-    if (gl_ranges)
-      remove_range(gl_ranges, ptr);
+    if (start == NULL && a->quick_bytes) {
+        mm_quick_flush(a);
+        start = mm_tree_fit(PTR(heap[2+TREE_BIN]), RUN_FIT);
+    }
+
+    if (start != NULL) {
+        size = HEAD_SIZE(start);
+        mm_malloc_rm_free(a, start);
+    } else {
+        word_t *heap_end = ARENA_END(a);
+
+        start = heap_end;
+        if (!HEAD_PALLOC(heap_end))
+            start -= HEAD_SIZE(&heap_end[-1])/WSIZE;
+
+        word_t *new_end = mm_slab_align(a, start) - 1 + RUN_BLOCK/WSIZE;
+        a->stats.sbrks++;
+        if (mem_region_sbrk(a->id, (new_end-heap_end)*WSIZE) == (void *)-1)
+            return NULL;
+
+        if (start != heap_end)
+            mm_malloc_rm_free(a, start);
+        HEAD_SET(new_end, 0, HEAD_ALLOC_MASK);
+        size = (new_end-start)*WSIZE;
+    }
+
+    word_t *run = mm_slab_place(a, start, size);
+    a->slab_map[SLAB_PAGE(a, run)/8] |= 1 << SLAB_PAGE(a, run)%8;
+
+    run[0] = slotsz;
+    run[1] = 0;
+    memset(&run[4], 0, RUN_MAP_WORDS*WSIZE);
+    mm_slab_link(heap, run);
+
+    return run;
 }
 
 /*
- *  mm_realloc - empty implementation; YOU DO NOT NEED TO IMPLEMENT THIS
+ * mm_slab_malloc - allocate a slot of size class c.
+ * Takes the first free slot of the first run of the class, allocating a new run
+ * if there is none, and removes the run from the list if it is now full.
  */
-void *mm_realloc(void *ptr, size_t t)
+static void *mm_slab_malloc(arena_t *a, int c)
 {
-    return NULL;
+    word_t *run = PTR(a->heap[SLAB_HEAD(c)]);
+
+    if (run == NULL && (run = mm_slab_new(a, (c+1)*ALIGNMENT)) == NULL)
+        return NULL;
+
+    size_t slotsz = run[0], w, i;
+    for (w = 0; !~run[4+w]; w++)
+        ;
+    i = __builtin_ctz(~run[4+w]);
+    run[4+w] |= (word_t)1 << i;
+    i += w*8*WSIZE;
+
+    if (++run[1] == (RUN_SIZE-RUN_HDR)/slotsz)
+        mm_slab_unlink(run);
+
+    return (char *)run + RUN_HDR + i*slotsz;
 }
 
 /*
- *  mm_exit - free all blocks by traversing the entire heap.
+ * mm_slab_free - free a slot.
+ * Clears the bit of the slot in its run, which is found by the address of the
+ * slot. If the run was full, it goes back to the list of its class, and if it
+ * is now empty, the run is released to the general heap.
  */
-void mm_exit(void)
+static void mm_slab_free(arena_t *a, void *ptr)
 {
-    size_t *heap = mem_heap_lo(), cursz;
-    heap++;
+    word_t *run = SLAB_RUN(a, ptr), slotsz = run[0];
+    size_t i = ((char *)ptr - (char *)run - RUN_HDR) / slotsz;
+    word_t *word = &run[4 + i/(8*WSIZE)], bit = (word_t)1 << i%(8*WSIZE);
+
+    // error on double-free
+    if (!(*word & bit)) {
+        fprintf(stderr, "double-free detected\n");
+        exit(1);
+    }
+    *word &= ~bit;
+
+    if (run[1]-- == (RUN_SIZE-RUN_HDR)/slotsz)
+        mm_slab_link(a->heap, run);
+
+    if (run[1] == 0) {
+        mm_slab_unlink(run);
+        a->slab_map[SLAB_PAGE(a, run)/8] &= ~(1 << SLAB_PAGE(a, run)%8);
+        mm_free_block(a, run-1);
+    }
+}
+
+/*
+ * mm_arena_fit - find a free block of at least reqsz bytes in a locked arena.
+ * First look for a best fit in the bin of the request, whose blocks may be too
+ * small. Then find the first non-empty larger bin through the bitmap, whose
+ * blocks are all large enough, and take its first block, setting *larger_hit.
+ * The last bin has no upper bound, so its treap is searched for a best fit
+ * instead. Returns NULL if there is no such block.
+ */
+static word_t *mm_arena_fit(arena_t *a, size_t reqsz, int *larger_hit)
+{
+    word_t *heap = a->heap, *cur_head = NULL, *head;
+    size_t cursz = 0;
+    int bin = mm_bin(reqsz);
+
+    *larger_hit = 0;
+    if (bin == TREE_BIN) {
+        // large request, best fit from the treap
+        cur_head = mm_tree_fit(PTR(heap[2+bin]), reqsz);
+    } else {
+        // scan the bin of the request, best fit
+        a->stats.searches++;
+        for (head = PTR(heap[2+bin]); head != NULL; head = PTR(head[2])) {
+            size_t sz = HEAD_SIZE(head);
+            a->stats.scanned++;
+            if (sz < reqsz || (cur_head != NULL && sz >= cursz))
+                continue;
+            cur_head = head;
+            cursz = sz;
+            if (cursz-reqsz <= reqsz/4)
+                break;
+        }
+
+        // otherwise, take the first block of the first non-empty larger bin
+        unsigned int larger = heap[1] & ~((2u << bin) - 1);
+        if (cur_head == NULL && larger) {
+            int i = __builtin_ctz(larger);
+            *larger_hit = 1;
+            if (i == TREE_BIN)
+                cur_head = mm_tree_fit(PTR(heap[2+i]), reqsz);
+            else
+                cur_head = PTR(heap[2+i]);
+        }
+    }
+    return cur_head;
+}
+
+/*
+ * mm_arena_malloc - allocate a block from a locked arena.
+ * Small requests are served from slabs once their class has been requested
+ * often enough. Otherwise, a block of the exact size is popped from its quick
+ * list if there is one. On a miss, a free block is found by mm_arena_fit, after
+ * flushing the quick lists if it finds none at first, or else a new block is
+ * allocated with mm_malloc_new.
+ */
+static void *mm_arena_malloc(arena_t *a, size_t size)
+{
+    word_t *heap = a->heap;
+
+    if (size <= SLAB_MAX) {
+        int c = (size-1)/ALIGNMENT;
+        void *slot;
+
+        if (heap[SLAB_COUNT(c)] < SLAB_THRESHOLD)
+            heap[SLAB_COUNT(c)]++;
+        else if ((slot = mm_slab_malloc(a, c)) != NULL) {
+            a->stats.slab_hits++;
+            return slot;
+        }
+    }
+
+    size_t reqsz = ALIGN(size + WSIZE);
+    if (reqsz < MIN_BLOCK)
+        reqsz = MIN_BLOCK;
+
+    if (reqsz <= QUICK_MAX && a->quick[reqsz/ALIGNMENT-1]) {
+        // reuse a block of the same size whose free was deferred
+        int c = reqsz/ALIGNMENT - 1;
+        word_t *block = PTR(a->quick[c]);
+        if ((a->quick[c] = block[1]) == 0)
+            a->quick_map &= ~(1ull << c);
+        block[2] = 0;
+        a->quick_bytes -= reqsz;
+        a->stats.quick_hits++;
+        return (void *)&block[1];
+    }
+
+    int larger_hit = 0;
+    word_t *cur_head = mm_arena_fit(a, reqsz, &larger_hit);
+    size_t cursz;
+
+    // a miss: coalesce the deferred frees before growing the heap
+    if (cur_head == NULL && a->quick_bytes) {
+        mm_quick_flush(a);
+        cur_head = mm_arena_fit(a, reqsz, &larger_hit);
+    }
+
+    // no appropriate block found
+    if (cur_head == NULL) {
+        a->stats.grow_hits++;
+        return mm_malloc_new(a, reqsz);
+    }
+    // else, reuse existing block at cur_head
+    cursz = HEAD_SIZE(cur_head);
+    if (larger_hit)
+        a->stats.larger_hits++;
+    else
+        a->stats.bin_hits++;
+
+    // remove from free list
+    mm_malloc_rm_free(a, cur_head);
+
+    // splitting logic, only split if the other part is large enough
+    if (cursz - reqsz >= MIN_BLOCK) {
+        size_t restsz = cursz - reqsz;
+
+        HEAD_SET(&cur_head[reqsz/WSIZE], restsz, HEAD_PALLOC_MASK);
+        HEAD_SET(&cur_head[cursz/WSIZE-1], restsz, HEAD_PALLOC_MASK);
+
+        mm_malloc_new_free(a, &cur_head[reqsz/WSIZE]);
+        a->stats.splits++;
+        cursz = reqsz;
+    } else {
+        // the next block now follows an allocated block
+        HEAD_SET_PALLOC(&cur_head[cursz/WSIZE]);
+    }
+
+    // set cur header, the previous block of a free block is always allocated
+    HEAD_SET(cur_head, cursz, HEAD_ALLOC_MASK|HEAD_PALLOC_MASK);
+
+    return (void *)&cur_head[1];
+}
+
+/*
+ * mm_arena_free - free a block into its locked arena.
+ * Slots are recognized by address and freed into their run, small blocks go
+ * to the quick list of their size, and other blocks are coalesced and returned
+ * to the free lists by mm_free_block.
+ */
+static void mm_arena_free(arena_t *a, void *ptr)
+{
+    word_t *block = ((word_t *)ptr)-1;
+
+    if (SLAB_IS_RUN(a, ptr)) {
+        mm_slab_free(a, ptr);
+    } else {
+        // error on double-free
+        if (!HEAD_ALLOC(block)) {
+            fprintf(stderr, "double-free detected\n");
+            exit(1);
+        }
+        if (!mm_quick_put(a, block))
+            mm_free_block(a, block);
+    }
+}
+
+/*
+ * mm_remote_drain - free every block of the remote stack of a locked arena.
+ * The whole stack is taken at once by swapping in an empty one, so the holder
+ * of the lock is its only consumer and pushes never wait on it.
+ */
+static void mm_remote_drain(arena_t *a)
+{
+    word_t head = __atomic_exchange_n(&a->remote, 0, __ATOMIC_ACQUIRE);
+    word_t *slot = PTR(head);
+
+    while (slot != NULL) {
+        word_t *next = PTR(slot[0]);
+        slot[1] = 0;
+        mm_arena_free(a, slot);
+        slot = next;
+    }
+}
+
+/*
+ * mm_usable - usable size of an allocated slot or block, 0 if it is free.
+ * This is safe without the arena lock for a block the caller owns: other
+ * threads may change the same header or bitmap word under the lock, but never
+ * the size or the bit of this block.
+ */
+static size_t mm_usable(arena_t *a, void *ptr)
+{
+    word_t *block = ((word_t *)ptr)-1;
+
+    if (SLAB_IS_RUN(a, ptr)) {
+        word_t *run = SLAB_RUN(a, ptr);
+        size_t i = ((char *)ptr - (char *)run - RUN_HDR) / run[0];
+        if (!(run[4 + i/(8*WSIZE)] & (word_t)1 << i%(8*WSIZE)))
+            return 0;
+        return run[0];
+    }
+    return HEAD_ALLOC(block) ? HEAD_SIZE(block) - WSIZE : 0;
+}
+
+/*
+ * mm_remote_push - hand a block freed by a thread of another arena to its own.
+ * The block is pushed on the remote stack of its arena with a compare and swap,
+ * linked through its first word and marked in its second. A block that is
+ * already marked, for this stack or for the quick lists of the arena, is either
+ * being freed twice or merely holds the same bytes, so it is freed under the
+ * lock instead, after draining the stack, where a double free is caught as
+ * usual. If the arena cannot be locked, its heap is not of this generation and
+ * could not be set up, so the block is no block of it any more and is dropped.
+ */
+static void mm_remote_push(arena_t *a, void *ptr)
+{
+    word_t *slot = ptr, mark = OFF(&a->remote), head;
+
+    if (slot[1] == mark || slot[1] == QUICK_MARK(a)) {
+        if (mm_lock(a) == NULL)
+            return;
+        mm_remote_drain(a);
+        mm_arena_free(a, ptr);
+        mm_unlock(a);
+        return;
+    }
+
+    slot[1] = mark;
+    head = __atomic_load_n(&a->remote, __ATOMIC_RELAXED);
+    do {
+        slot[0] = head;
+    } while (!__atomic_compare_exchange_n(&a->remote, &head, OFF(slot), 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * mm_tcache_put - keep a freed block of the thread's own arena in its cache.
+ * A block goes to the class of the largest requests it can serve, if that class
+ * is small enough and not full. A cached block links to the next one in its
+ * first word, and holds the key of the owning cache in its second, so that
+ * freeing it again is caught (confirmed by a scan of its class) instead of
+ * caching it twice. A block marked as on the quick lists is left to the arena,
+ * which catches it being freed twice. Returns 0 if the block was not cached.
+ */
+static int mm_tcache_put(tcache_t *t, arena_t *a, void *ptr)
+{
+    size_t u = mm_usable(a, ptr);
+    word_t *slot = ptr, *q;
+    int c;
+
+    if (u < 2*WSIZE || u > TCACHE_MAX)
+        return 0;
+    c = u/WSIZE - 1;
+
+    if (slot[1] == t->key) {
+        // error on double-free
+        for (q = PTR(t->head[c]); q != NULL; q = PTR(q[0])) {
+            if (q == slot) {
+                fprintf(stderr, "double-free detected\n");
+                exit(1);
+            }
+        }
+    }
+    if (t->count[c] == TCACHE_COUNT || slot[1] == QUICK_MARK(a))
+        return 0;
+
+    slot[0] = t->head[c];
+    slot[1] = t->key;
+    t->head[c] = OFF(slot);
+    t->map |= 1u << c;
+    t->count[c]++;
+    return 1;
+}
+
+/*
+ * mm_tcache_get - take a block for a request of size bytes from the cache.
+ * Blocks may be a little larger than the class of the request, as the usable
+ * sizes of blocks and slots fall on different classes, so the first non-empty
+ * class up to ALIGNMENT bytes above it is taken, found through the bitmap.
+ * Returns NULL if there is none.
+ */
+static void *mm_tcache_get(tcache_t *t, size_t size)
+{
+    int c = (size-1)/WSIZE;
+    unsigned int map = (t->map >> c) & ((1u << ALIGNMENT/WSIZE) - 1);
+    word_t *slot;
+
+    if (!map)
+        return NULL;
+    c += __builtin_ctz(map);
+
+    slot = PTR(t->head[c]);
+    t->head[c] = slot[0];
+    if (--t->count[c] == 0)
+        t->map &= ~(1u << c);
+    slot[1] = 0;
+    return slot;
+}
+
+/*
+ * mm_stats_add - add the counters of src to those of dst; every field of
+ * mm_stats_t is an unsigned long long counter.
+ */
+static void mm_stats_add(mm_stats_t *dst, const mm_stats_t *src)
+{
+    unsigned long long *d = (unsigned long long *)dst;
+    const unsigned long long *s = (const unsigned long long *)src;
+    size_t i;
+
+    for (i = 0; i < sizeof(mm_stats_t)/sizeof(*d); i++)
+        d[i] += s[i];
+}
+
+/*
+ * mm_tcache_flush - give every block of a thread cache back to its arena,
+ * along with the counters of the thread, and trim the arena if that freed the
+ * end of its heap.
+ */
+static void mm_tcache_flush(tcache_t *t)
+{
+    arena_t *a = &mm_arenas[t->arena];
+    word_t *slot;
+    int c;
+
+    if (mm_lock(a) == NULL)
+        return;
+    for (c = 0; c < TCACHE_CLASSES; c++) {
+        while ((slot = PTR(t->head[c])) != NULL) {
+            t->head[c] = slot[0];
+            mm_arena_free(a, slot);
+        }
+        t->count[c] = 0;
+    }
+    t->map = 0;
+    mm_stats_add(&a->stats, &t->stats);
+    memset(&t->stats, 0, sizeof(t->stats));
+    mm_arena_trim(a);
+    mm_unlock(a);
+}
+
+/*
+ * mm_thread_exit - flush the cache of an exiting thread, unless it is stale.
+ */
+static void mm_thread_exit(void *p)
+{
+    tcache_t *t = p;
+
+    if (t->gen == __atomic_load_n(&mm_gen, __ATOMIC_ACQUIRE))
+        mm_tcache_flush(t);
+}
+
+/*
+ * mm_huge_malloc - allocate a huge block in a mapping of its own.
+ */
+static void *mm_huge_malloc(size_t size)
+{
+    size_t pg = mem_pagesize(), mapsz = (HUGE_HDR + size + pg-1) & ~(pg-1);
+    size_t *map = mem_map(mapsz);
+
+    if (map == NULL)
+        return NULL;
+    map[2] = mapsz;
+
+    mm_spin_lock(&mm_huge_lock);
+    map[0] = 0;
+    map[1] = (size_t)mm_huge;
+    if (mm_huge)
+        mm_huge[0] = (size_t)map;
+    mm_huge = map;
+    mm_spin_unlock(&mm_huge_lock);
+
+    return (char *)map + HUGE_HDR;
+}
+
+/*
+ * mm_huge_free - free a huge block, giving its mapping back at once.
+ */
+static void mm_huge_free(void *ptr)
+{
+    size_t *map = (size_t *)((char *)ptr - HUGE_HDR);
+
+    // error on double-free, or on a pointer that is no block at all
+    if (!mem_mapped(map, map)) {
+        fprintf(stderr, "double-free detected\n");
+        exit(1);
+    }
+
+    mm_spin_lock(&mm_huge_lock);
+    if (map[0])
+        ((size_t *)map[0])[1] = map[1];
+    else
+        mm_huge = (size_t *)map[1];
+    if (map[1])
+        ((size_t *)map[1])[0] = map[0];
+    mm_spin_unlock(&mm_huge_lock);
+
+    mem_unmap(map, map[2]);
+}
+
+/*
+ * mm_malloc - allocate a block.
+ * Small requests are served from the thread cache without any locking when it
+ * has a block of their class, everything else is allocated from the arena of
+ * the thread under its lock. Blocks freed into the arena by other threads are
+ * first drained from its remote stack, if there are any. Huge requests bypass
+ * the arenas altogether.
+ */
+void *mm_malloc(size_t size)
+{
+    MM_DEBUG_CHECK();
+    if (size == 0)
+        return NULL;
+
+    tcache_t *t = mm_thread();
+    t->stats.mallocs++;
+    if (size >= MMAP_THRESHOLD) {
+        t->stats.huge_mallocs++;
+        return mm_huge_malloc(size);
+    }
+
+    arena_t *a = &mm_arenas[t->arena];
+    int remote = __atomic_load_n(&a->remote, __ATOMIC_RELAXED) != 0;
+    void *ptr;
+
+    if (!remote && size <= TCACHE_MAX && (ptr = mm_tcache_get(t, size))) {
+        t->stats.tcache_hits++;
+        return ptr;
+    }
+
+    if (mm_lock(a) == NULL)
+        return NULL;
+    if (remote)
+        mm_remote_drain(a);
+    ptr = mm_arena_malloc(a, size);
+    mm_unlock(a);
+    return ptr;
+}
+
+/*
+ * mm_free - free a block.
+ * The arena of the block is found from its address, and a block in no arena is
+ * a huge one. Blocks of another arena are pushed on its remote stack without
+ * locking. Small blocks of the thread's own arena go to its cache if there is
+ * room, other blocks are freed into the arena under its lock, or dropped if it
+ * cannot be locked, as mm_remote_push does. Freeing NULL does nothing, as with
+ * free.
+ */
+void mm_free(void *ptr)
+{
+    MM_DEBUG_CHECK();
+    if (ptr == NULL)
+        return;
+
+    tcache_t *t = mm_thread();
+    int id = mem_region_of(ptr);
+
+    t->stats.frees++;
+    if (id < 0) {
+        mm_huge_free(ptr);
+    } else if (id != t->arena) {
+        t->stats.remote_frees++;
+        mm_remote_push(&mm_arenas[id], ptr);
+    } else if (mm_tcache_put(t, &mm_arenas[id], ptr)) {
+        t->stats.tcache_puts++;
+    } else if (mm_lock(&mm_arenas[id]) != NULL) {
+        mm_arena_free(&mm_arenas[id], ptr);
+        mm_unlock(&mm_arenas[id]);
+    }
+
+    /* DON'T MODIFY THIS STAGE AND LEAVE IT AS IT WAS */
+    if (gl_ranges)
+      remove_range(gl_ranges, ptr);
+}
+
+/*
+ * mm_resize - resize a block in place in its locked arena.
+ * A block that grows takes the free block after it (flushing the quick lists
+ * first if that block is on one) and, if the block is (or is then) the last in
+ * the heap, extends the heap by what it needs. Of a free block taken, it keeps
+ * up to its size rounded as by mm_malloc_new, so a buffer grown step by step
+ * finds room in its own slack next time, and only what lies beyond that is
+ * split off and freed; the last block can always grow again, so the heap is
+ * not extended for slack. A block that shrinks keeps its slack unless it gives
+ * back at least a quarter of its size, as the rounding would, and then frees
+ * its tail if that is large enough to be a block. Whether the block can grow is
+ * known before any of this is done, so a block that cannot is left as it was.
+ * Returns 0 if the block could not be resized in place.
+ */
+static int mm_resize(arena_t *a, word_t *block, size_t size)
+{
+    size_t reqsz = ALIGN(size + WSIZE);
+    if (reqsz < MIN_BLOCK)
+        reqsz = MIN_BLOCK;
+    size_t cursz = HEAD_SIZE(block);
+
+    word_t *next = &block[cursz/WSIZE];
+    if (reqsz > cursz && HEAD_ALLOC(next) && HEAD_SIZE(next) != 0 &&
+            HEAD_SIZE(next) <= QUICK_MAX && next[2] == QUICK_MARK(a)) {
+        // the block after this one is free, but on a quick list
+        mm_quick_flush(a);
+    }
+    size_t keepsz = reqsz;
+    if (reqsz > cursz) {
+        // room in place: the free block after this one, if any, and then the
+        // heap beyond, if that block (or else this one) is the last
+        size_t room = cursz + (HEAD_ALLOC(next) ? 0 : HEAD_SIZE(next));
+
+        keepsz = mm_round(reqsz);
+        if (reqsz > room) {
+            if (HEAD_SIZE(&block[room/WSIZE]) != 0)
+                return 0;
+            // last block of the heap, extend it
+            a->stats.sbrks++;
+            if (mem_region_sbrk(a->id, reqsz-room) == (void *)-1)
+                return 0;
+        }
+        if (!HEAD_ALLOC(next)) {
+            // absorb the free block after this one
+            mm_malloc_rm_free(a, next);
+            a->stats.coalesces++;
+        }
+        if (reqsz > room) {
+            room = reqsz;
+            HEAD_SET(&block[room/WSIZE], 0, HEAD_ALLOC_MASK|HEAD_PALLOC_MASK);
+        } else {
+            HEAD_SET_PALLOC(&block[room/WSIZE]);
+        }
+        if (keepsz > room)
+            keepsz = room;
+        cursz = room;
+        HEAD_SET(block, cursz, HEAD_DATA(block));
+    } else if (cursz - reqsz < cursz/4) {
+        // shrinking by little, keep the slack for the block to grow back into
+        keepsz = cursz;
+    }
+
+    // give back the tail if it is large enough
+    if (cursz - keepsz >= MIN_BLOCK) {
+        word_t *tail = &block[keepsz/WSIZE];
+        HEAD_SET(block, keepsz, HEAD_DATA(block));
+        HEAD_SET(tail, cursz-keepsz, HEAD_ALLOC_MASK|HEAD_PALLOC_MASK);
+        mm_free_block(a, tail);
+        a->stats.splits++;
+    }
+    return 1;
+}
+
+/*
+ * mm_realloc - resize a block, in place whenever possible.
+ * A slot stays where it is as long as the new size fits in it, and so does a
+ * huge block as long as it stays huge and fills at least half its mapping.
+ * Other blocks are resized in place by mm_resize under the lock of their arena,
+ * after draining its remote stack, unless they grow huge: like mm_malloc, they
+ * then move to a mapping of their own, rather than pin the top of the heap.
+ * Only when the block is not resized in place is the payload moved to a new
+ * block. Returns NULL, leaving the block as it was, if its arena cannot be
+ * locked or no new block can be allocated.
+ */
+void *mm_realloc(void *ptr, size_t size)
+{
+    MM_DEBUG_CHECK();
+    if (ptr == NULL)
+        return mm_malloc(size);
+    if (size == 0) {
+        mm_free(ptr);
+        return NULL;
+    }
+
+    int id = mem_region_of(ptr);
+    arena_t *a;
+    size_t oldsz;
+    void *newp;
+
+    mm_thread()->stats.reallocs++;
+
+    if (id < 0) {
+        // a huge block stays in its mapping if it fits without wasting half
+        size_t mapsz = ((size_t *)((char *)ptr - HUGE_HDR))[2];
+        if (size >= MMAP_THRESHOLD && HUGE_HDR + size <= mapsz &&
+                HUGE_HDR + size > mapsz/2)
+            return ptr;
+        oldsz = mapsz - HUGE_HDR;
+        goto move;
+    }
+    a = &mm_arenas[id];
+
+    if (SLAB_IS_RUN(a, ptr)) {
+        if (size <= SLAB_RUN(a, ptr)[0])
+            return ptr;
+    } else if (size < MMAP_THRESHOLD) {
+        int fits;
+
+        if (mm_lock(a) == NULL)
+            return NULL;
+        if (__atomic_load_n(&a->remote, __ATOMIC_RELAXED))
+            mm_remote_drain(a);
+        fits = mm_resize(a, ((word_t *)ptr)-1, size);
+        mm_unlock(a);
+        if (fits)
+            return ptr;
+    }
+    oldsz = mm_usable(a, ptr);
+
+move:
+    mm_thread()->stats.realloc_moves++;
+    if ((newp = mm_malloc(size)) == NULL)
+        return NULL;
+    memcpy(newp, ptr, oldsz < size ? oldsz : size);
+    mm_free(ptr);
+    return newp;
+}
+
+/*
+ * mm_check_fail - report an inconsistency found by mm_check at address p.
+ * Returns 0, for mm_check to return.
+ */
+static int mm_check_fail(int id, void *p, const char *what)
+{
+    fprintf(stderr, "mm_check: arena %d: %p: %s\n", id, p, what);
+    return 0;
+}
+
+/*
+ * mm_check_mark - mark a block found on a free or run list in marks, which has
+ * a bit for every ALIGNMENT bytes of the arena. Any block of a list must lie
+ * in the arena, with an aligned payload, and be on no list yet, which also
+ * keeps a cycle in a list from being followed forever. Returns 0 if not.
+ */
+static int mm_check_mark(arena_t *a, word_t *block, unsigned char *marks)
+{
+    size_t i = ((char *)&block[1] - a->lo) / ALIGNMENT;
+
+    if (block <= a->heap || block >= ARENA_END(a))
+        return mm_check_fail(a->id, block, "list link out of the arena");
+    if ((uintptr_t)&block[1] % ALIGNMENT)
+        return mm_check_fail(a->id, block, "list link misaligned");
+    if (marks[i/8] & 1 << i%8)
+        return mm_check_fail(a->id, block, "on the lists twice");
+    marks[i/8] |= 1 << i%8;
+    return 1;
+}
+
+/*
+ * mm_check_tree - check the treap rooted at root, whose blocks must all be
+ * ordered after lo and before hi (either of which may be NULL), and have no
+ * higher priority than its parent. Counts its blocks in *n.
+ */
+static int mm_check_tree(arena_t *a, word_t *root, word_t *lo, word_t *hi,
+        unsigned int prio, unsigned char *marks, size_t *n)
+{
+    if (root == NULL)
+        return 1;
+    if (!mm_check_mark(a, root, marks))
+        return 0;
+    if (HEAD_ALLOC(root) || mm_bin(HEAD_SIZE(root)) != TREE_BIN)
+        return mm_check_fail(a->id, root,
+                             "in the treap, but no large free block");
+    if ((lo && !mm_tree_less(lo, root)) || (hi && !mm_tree_less(root, hi)))
+        return mm_check_fail(a->id, root, "out of order in the treap");
+    if (mm_tree_prio(root) > prio)
+        return mm_check_fail(a->id, root, "treap priority above its parent's");
+    (*n)++;
+    return mm_check_tree(a, PTR(root[1]), lo, root, mm_tree_prio(root),
+                         marks, n) &&
+        mm_check_tree(a, PTR(root[2]), root, hi, mm_tree_prio(root),
+                      marks, n);
+}
+
+/*
+ * mm_check_lists - check the free lists and run lists of an arena, marking
+ * every block on them. Every block on a free list must be free and in the bin
+ * of its size, with a "prev" link back to the block before it (or the
+ * pseudo-block of the bin), and the bitmap must tell exactly the non-empty
+ * bins. Every run on a run list must be a run of its class with free slots.
+ * Every block on a quick list must be an allocated block of its size, marked,
+ * and the blocks must add up to the byte count of the lists. Counts the blocks
+ * on the free lists in *nfree.
+ */
+static int mm_check_lists(arena_t *a, unsigned char *marks, size_t *nfree)
+{
+    word_t *heap = a->heap, *block, *back;
+    size_t n, quick = 0;
+    int bin, c;
+
+    *nfree = 0;
+    for (bin = 0; bin < NBINS; bin++) {
+        n = 0;
+        if (bin == TREE_BIN) {
+            if (!mm_check_tree(a, PTR(heap[2+bin]), NULL, NULL, ~0u, marks,
+                               &n))
+                return 0;
+        } else {
+            back = &heap[bin];
+            for (block = PTR(heap[2+bin]); block != NULL;
+                    back = block, block = PTR(block[2])) {
+                if (!mm_check_mark(a, block, marks))
+                    return 0;
+                if (HEAD_ALLOC(block))
+                    return mm_check_fail(a->id, block,
+                                         "allocated, but on a free list");
+                if (mm_bin(HEAD_SIZE(block)) != bin)
+                    return mm_check_fail(a->id, block,
+                                         "on the free list of another bin");
+                if (PTR(block[1]) != back)
+                    return mm_check_fail(a->id, block, "bad prev link");
+                n++;
+            }
+        }
+        if (!n != !(heap[1] & 1u << bin))
+            return mm_check_fail(a->id, &heap[1],
+                                 "bitmap disagrees with a bin");
+        if (n != a->stats.free_blocks[bin])
+            return mm_check_fail(a->id, &heap[2+bin],
+                                 "free block count of a bin is off");
+        *nfree += n;
+    }
+
+    for (c = 0; c < NSLABS; c++) {
+        back = &heap[SLAB_HEAD(c)-3];
+        for (block = PTR(heap[SLAB_HEAD(c)]); block != NULL;
+                back = block, block = PTR(block[3])) {
+            if (!mm_check_mark(a, block-1, marks))
+                return 0;
+            if (!SLAB_IS_RUN(a, block) || block[0] != (word_t)(c+1)*ALIGNMENT)
+                return mm_check_fail(a->id, block,
+                                     "on a run list, but no run of its class");
+            if (block[1] >= (RUN_SIZE-RUN_HDR)/block[0])
+                return mm_check_fail(a->id, block, "full run on a run list");
+            if (PTR(block[2]) != back)
+                return mm_check_fail(a->id, block, "bad prev link of a run");
+        }
+    }
+
+    for (c = 0; c < QUICK_CLASSES; c++) {
+        for (block = PTR(a->quick[c]); block != NULL; block = PTR(block[1])) {
+            if (!mm_check_mark(a, block, marks))
+                return 0;
+            if (!HEAD_ALLOC(block) || SLAB_IS_RUN(a, &block[1]) ||
+                    HEAD_SIZE(block) != (word_t)(c+1)*ALIGNMENT ||
+                    block[2] != QUICK_MARK(a))
+                return mm_check_fail(a->id, block,
+                                     "bad block on a quick list");
+            quick += HEAD_SIZE(block);
+        }
+        if (!a->quick[c] != !(a->quick_map & 1ull << c))
+            return mm_check_fail(a->id, &a->quick[c],
+                                 "quick list bitmap disagrees with a list");
+    }
+    if (quick != a->quick_bytes)
+        return mm_check_fail(a->id, a->quick, "quick list byte count is off");
+    return 1;
+}
+
+/*
+ * mm_check_run - check the run of an allocated block: it must start its page
+ * and hold slots of a slab class, with as many used as its bitmap has bits
+ * set, and be on the run list of its class if and only if it has free slots.
+ */
+static int mm_check_run(arena_t *a, word_t *run, unsigned char *marks)
+{
+    size_t i = ((char *)run - a->lo) / ALIGNMENT, used = 0, w;
+    int listed = (marks[i/8] >> i%8) & 1;
+
+    if (SLAB_RUN(a, run) != run)
+        return mm_check_fail(a->id, run, "run not at the start of its page");
+    if (run[0] % ALIGNMENT || run[0] == 0 || run[0] > SLAB_MAX)
+        return mm_check_fail(a->id, run, "bad slot size");
+    for (w = 0; w < RUN_MAP_WORDS; w++)
+        used += __builtin_popcount(run[4+w]);
+    if (used != run[1] || used > (RUN_SIZE-RUN_HDR)/run[0])
+        return mm_check_fail(a->id, run,
+                             "used slot count disagrees with bitmap");
+    if (listed != (used < (RUN_SIZE-RUN_HDR)/run[0]))
+        return mm_check_fail(a->id, run, listed ? "full run on a run list" :
+                             "run with free slots on no run list");
+    return 1;
+}
+
+/*
+ * mm_check_arena - check the heap of a locked arena. Its lists are checked
+ * first, and then every block in address order from the prologue to the
+ * epilogue: its payload must be aligned, its size a multiple of ALIGNMENT and
+ * at least the minimum, and its "previous block allocated" flag right. A free
+ * block must have a footer that agrees with its header, must not follow
+ * another free block, and must be on a free list. The epilogue must be the
+ * last word of the region. The counts of free blocks and bytes kept for
+ * mm_stats must agree, and the thread cache of the caller must only hold
+ * allocated blocks of the arena.
+ */
+static int mm_check_arena(arena_t *a)
+{
+    word_t *heap = a->heap, *end = ARENA_END(a), *block, *slot;
+    size_t bytes = (char *)end - a->lo + WSIZE, nfree, nwalked = 0;
+    size_t size, freesz = 0;
+    unsigned char *marks;
+    tcache_t *t = &mm_tcache;
+    int palloc = 1, ok = 0, c;
+
+    if ((marks = calloc(bytes/ALIGNMENT/8 + 1, 1)) == NULL)
+        return mm_check_fail(a->id, NULL, "no memory to check the arena");
+
+    if (heap != ARENA_BASE(a->id) || HEAD_SIZE(heap) != PRO_SIZE ||
+            !HEAD_ALLOC(heap)) {
+        mm_check_fail(a->id, heap, "bad prologue");
+        goto out;
+    }
+    if (!mm_check_lists(a, marks, &nfree))
+        goto out;
+
+    for (block = &heap[PRO_SIZE/WSIZE]; block < end; block += size/WSIZE) {
+        size = HEAD_SIZE(block);
+        if ((uintptr_t)&block[1] % ALIGNMENT) {
+            mm_check_fail(a->id, block, "misaligned payload");
+            goto out;
+        }
+        if (size < MIN_BLOCK || size % ALIGNMENT ||
+                size > (size_t)(end-block)*WSIZE) {
+            mm_check_fail(a->id, block, "bad block size");
+            goto out;
+        }
+        if (!HEAD_PALLOC(block) != !palloc) {
+            mm_check_fail(a->id, block, "wrong previous-block-allocated flag");
+            goto out;
+        }
+        if (HEAD_ALLOC(block)) {
+            if (SLAB_IS_RUN(a, &block[1]) && !mm_check_run(a, &block[1], marks))
+                goto out;
+        } else {
+            size_t i = ((char *)&block[1] - a->lo) / ALIGNMENT;
+            if (!palloc) {
+                mm_check_fail(a->id, block, "two free blocks in a row");
+                goto out;
+            }
+            if (HEAD_SIZE(&block[size/WSIZE-1]) != size) {
+                mm_check_fail(a->id, block, "footer disagrees with header");
+                goto out;
+            }
+            if (!(marks[i/8] & 1 << i%8)) {
+                mm_check_fail(a->id, block, "free block on no free list");
+                goto out;
+            }
+            nwalked++;
+            freesz += size;
+        }
+        palloc = HEAD_ALLOC(block);
+    }
+
+    if (block != end || HEAD_SIZE(end) != 0 || !HEAD_ALLOC(end) ||
+            !HEAD_PALLOC(end) != !palloc) {
+        mm_check_fail(a->id, end, "bad epilogue");
+        goto out;
+    }
+    if (nwalked != nfree) {
+        mm_check_fail(a->id, NULL, "free lists hold blocks the heap does not");
+        goto out;
+    }
+    if (freesz != a->stats.free_bytes) {
+        mm_check_fail(a->id, NULL, "free byte count is off");
+        goto out;
+    }
+
+    if (t->gen == mm_gen && t->arena == a->id) {
+        for (c = 0; c < TCACHE_CLASSES; c++) {
+            size_t n = 0;
+            for (slot = PTR(t->head[c]); slot != NULL; slot = PTR(slot[0])) {
+                if (mem_region_of(slot) != a->id || mm_usable(a, slot) == 0 ||
+                        ++n > t->count[c]) {
+                    mm_check_fail(a->id, slot, "bad block in the thread cache");
+                    goto out;
+                }
+            }
+            if (n != t->count[c] || !n != !(t->map & 1u << c)) {
+                mm_check_fail(a->id, &t->head[c], "thread cache count is off");
+                goto out;
+            }
+        }
+    }
+    ok = 1;
+out:
+    free(marks);
+    return ok;
+}
+
+/*
+ * mm_check - check the consistency of the heap of every arena, each under its
+ * lock, and of the list of huge blocks, whose links must go both ways between
+ * live mappings. Returns nonzero if everything is consistent.
+ */
+int mm_check(void)
+{
+    size_t *map, *prev = NULL;
+    int i, ok = 1;
+
+    for (i = 0; i < NARENAS; i++) {
+        arena_t *a = &mm_arenas[i];
+
+        mm_spin_lock(&a->lock);
+        if (a->gen == mm_gen && !mm_check_arena(a))
+            ok = 0;
+        mm_unlock(a);
+    }
+
+    mm_spin_lock(&mm_huge_lock);
+    for (map = mm_huge; map != NULL; prev = map, map = (size_t *)map[1]) {
+        if (!mem_mapped(map, (char *)map + map[2] - 1) ||
+                (size_t *)map[0] != prev) {
+            ok = mm_check_fail(-1, map, "bad huge block");
+            break;
+        }
+    }
+    mm_spin_unlock(&mm_huge_lock);
+    return ok;
+}
+
+/*
+ * mm_profile - sample the shape of the heap, by traversing the heap of every
+ * arena as mm_exit does, and then the list of huge blocks. The arenas are only
+ * read, each under its lock, so blocks on the remote stacks count as in use.
+ */
+void mm_profile(mm_profile_t *prof)
+{
+    tcache_t *t = mm_thread();
+    word_t *slot;
+    size_t *map;
+    int i;
+
+    memset(prof, 0, sizeof(*prof));
+    prof->heap = mem_heapsize();
+
+    for (i = 0; i < NARENAS; i++) {
+        arena_t *a = &mm_arenas[i];
+        word_t *heap;
+        size_t cursz;
+
+        mm_spin_lock(&a->lock);
+        if (a->gen != mm_gen) {
+            mm_unlock(a);
+            continue;
+        }
+
+        heap = &a->heap[HEAD_SIZE(a->heap)/WSIZE];
+        while ((cursz = HEAD_SIZE(heap)) != 0) {
+            if (HEAD_ALLOC(heap) && SLAB_IS_RUN(a, heap+1)) {
+                word_t *run = heap+1;
+                size_t slots = (RUN_SIZE-RUN_HDR)/run[0];
+                prof->used += run[1]*run[0];
+                prof->cached += (slots-run[1])*run[0];
+            } else if (HEAD_ALLOC(heap)) {
+                prof->used += cursz;
+            } else {
+                int lg = 8*sizeof(unsigned int) - 1 -
+                    __builtin_clz((unsigned int)cursz);
+                prof->free += cursz;
+                prof->free_blocks++;
+                if (cursz > prof->largest_free)
+                    prof->largest_free = cursz;
+                prof->free_hist[lg-4 < MM_PROFILE_BUCKETS ?
+                    lg-4 : MM_PROFILE_BUCKETS-1]++;
+            }
+            heap = &heap[cursz/WSIZE];
+        }
+
+        // and so are the blocks on the quick lists
+        prof->used -= a->quick_bytes;
+        prof->cached += a->quick_bytes;
+        mm_unlock(a);
+    }
+
+    // the blocks in the calling thread's cache are counted as used above
+    for (i = 0; i < TCACHE_CLASSES; i++) {
+        for (slot = PTR(t->head[i]); slot != NULL; slot = PTR(slot[0])) {
+            arena_t *a = &mm_arenas[t->arena];
+            size_t sz = SLAB_IS_RUN(a, slot) ? SLAB_RUN(a, slot)[0] :
+                HEAD_SIZE(slot-1);
+            prof->used -= sz;
+            prof->cached += sz;
+        }
+    }
+
+    mm_spin_lock(&mm_huge_lock);
+    for (map = mm_huge; map != NULL; map = (size_t *)map[1])
+        prof->used += map[2];
+    mm_spin_unlock(&mm_huge_lock);
+}
+
+/*
+ * mm_stats - report the statistics of the allocator since mm_init.
+ * The event counters are kept where they are cheapest to update: those of the
+ * locked paths in the arenas, in a cache line of their own, and those of the
+ * lock-free paths in the thread caches, which are added to their arena as they
+ * are flushed. The calling thread's are included as they are. The number of
+ * allocated bytes of an arena is what its region holds besides the prologue
+ * and the free blocks.
+ */
+void mm_stats(mm_stats_t *stats)
+{
+    tcache_t *t = mm_thread();
+    size_t *map;
+    int i;
+
+    memset(stats, 0, sizeof(*stats));
+    mm_stats_add(stats, &t->stats);
+
+    for (i = 0; i < NARENAS; i++) {
+        arena_t *a = &mm_arenas[i];
+
+        mm_spin_lock(&a->lock);
+        if (a->gen == mm_gen) {
+            mm_stats_add(stats, &a->stats);
+            stats->alloc_bytes += (char *)mem_region_hi(i)+1 - a->lo -
+                (ALIGNMENT + PRO_SIZE) - a->stats.free_bytes;
+        }
+        mm_unlock(a);
+    }
+
+    mm_spin_lock(&mm_huge_lock);
+    for (map = mm_huge; map != NULL; map = (size_t *)map[1])
+        stats->alloc_bytes += map[2];
+    mm_spin_unlock(&mm_huge_lock);
+
+    stats->heap_bytes = mem_heapsize();
+}
+
+/*
+ * mm_trim - give the cache of the calling thread back to its arena, free the
+ * remote stacks and the quick lists, and trim every arena whose heap then ends
+ * in a large enough free block, as malloc_trim does. The caches of other
+ * threads are left alone.
+ */
+void mm_trim(void)
+{
+    int i;
+
+    mm_tcache_flush(mm_thread());
+    for (i = 0; i < NARENAS; i++) {
+        arena_t *a = &mm_arenas[i];
+
+        mm_spin_lock(&a->lock);
+        if (a->gen == mm_gen) {
+            mm_remote_drain(a);
+            mm_quick_flush(a);
+            mm_arena_trim(a);
+        }
+        mm_unlock(a);
+    }
+}
+
+/*
+ *  mm_exit - free all blocks by traversing the entire heap of every arena.
+ *  The cache of the calling thread, the remote stacks and the quick lists are
+ *  flushed first, the caches of other threads are expected to have been flushed
+ *  as they exited. The blocks freed onto the quick lists meanwhile are flushed
+ *  at the end. Trimming is turned off for the walk, which would otherwise read
+ *  the headers of memory given back by freeing the last block; the arena is
+ *  set up from scratch by the next mm_init anyway.
+ *  Runs are freed slot by slot, the last of which releases the run itself.
+ *  Huge blocks are freed last, from their list.
+ */
+void mm_exit(void)
+{
+    tcache_t *t = mm_thread();
+    int i;
+
+    MM_DEBUG_CHECK();
+    mm_tcache_flush(t);
+
+    for (i = 0; i < NARENAS; i++) {
+        arena_t *a = &mm_arenas[i];
+        word_t *heap;
+        size_t cursz;
+
+        mm_spin_lock(&a->lock);
+        if (a->gen != mm_gen) {
+            mm_unlock(a);
+            continue;
+        }
+        a->no_trim = 1;
+        mm_remote_drain(a);
+        mm_quick_flush(a);
+
+        heap = &a->heap[HEAD_SIZE(a->heap)/WSIZE];
+        while ((cursz = HEAD_SIZE(heap)) != 0) {
+            if (HEAD_ALLOC(heap) && SLAB_IS_RUN(a, heap+1)) {
+                word_t *run = heap+1;
+                size_t j;
+                for (j = 0; run[1] != 0; j++) {
+                    char *slot = (char *)run + RUN_HDR + j*run[0];
+                    if (run[4 + j/(8*WSIZE)] & (word_t)1 << j%(8*WSIZE)) {
+                        mm_arena_free(a, slot);
+                        if (gl_ranges)
+                            remove_range(gl_ranges, slot);
+                    }
+                }
+            } else if (HEAD_ALLOC(heap)) {
+                mm_arena_free(a, heap+1);
+                if (gl_ranges)
+                    remove_range(gl_ranges, (char *)(heap+1));
+            }
+            heap = &heap[cursz/WSIZE];
+        }
+        mm_quick_flush(a);
+        mm_unlock(a);
+    }
 
-    heap = &heap[HEAD_SIZE(heap)/sizeof(size_t)];
-    while ((cursz = HEAD_SIZE(heap)) != 0) {
-        if (HEAD_ALLOC(heap))
-            mm_free(heap+1);
-        heap = &heap[cursz/sizeof(size_t)];
+    while (mm_huge != NULL) {
+        char *ptr = (char *)mm_huge + HUGE_HDR;
+        mm_huge_free(ptr);
+        if (gl_ranges)
+            remove_range(gl_ranges, ptr);
     }
 }
 
@@ -20,6 +20,86 @@ extern void mm_free (void *ptr);
 extern void mm_exit (void);
 extern void *mm_realloc(void *ptr, size_t size);
 
+/*
+ * The shape of the heap at some point, as sampled by mm_profile. Sizes are
+ * in bytes, headers included. Blocks in the calling thread's cache or on the
+ * quick lists of the arenas and free slots of slab runs are neither in use nor
+ * free, but cached; what the heap holds besides used, free and cached bytes is
+ * the allocator's overhead.
+ */
+#define MM_PROFILE_BUCKETS 16  /* free blocks of 16-31, 32-63, ... bytes */
+
+typedef struct {
+    size_t heap;          /* size of the heap, as mem_heapsize */
+    size_t used;          /* bytes in blocks in use by the program */
+    size_t free;          /* bytes in free blocks */
+    size_t cached;        /* bytes in cached blocks and free slots */
+    size_t largest_free;  /* size of the largest free block */
+    size_t free_blocks;   /* number of free blocks, on all free lists */
+    size_t free_hist[MM_PROFILE_BUCKETS]; /* free blocks by size, the */
+                          /* last bucket holding all larger ones */
+} mm_profile_t;
+
+extern void mm_profile(mm_profile_t *prof);
+
+/*
+ * The allocator's statistics since mm_init, as returned by mm_stats. Every
+ * field is a counter, of bytes, blocks or events. The event counters of the
+ * other threads are only included once they flush their caches (as they exit,
+ * or at mm_exit).
+ */
+#define MM_STATS_BINS 32  /* number of free list bins */
+
+typedef struct {
+    /* the heap */
+    unsigned long long heap_bytes;   /* size of the heap, as mem_heapsize */
+    unsigned long long alloc_bytes;  /* bytes in allocated blocks, headers, */
+                                     /* slab runs and cached blocks included */
+    unsigned long long free_bytes;   /* bytes in free blocks */
+    unsigned long long free_blocks[MM_STATS_BINS]; /* free blocks per bin */
+
+    /* how mallocs were served: the sum of the *_hits and huge_mallocs */
+    unsigned long long mallocs;
+    unsigned long long tcache_hits;  /* from the thread cache */
+    unsigned long long quick_hits;   /* from the quick list of their size */
+    unsigned long long slab_hits;    /* from a slab run */
+    unsigned long long bin_hits;     /* from the bin of the request */
+    unsigned long long larger_hits;  /* from a larger bin, by the bitmap */
+    unsigned long long grow_hits;    /* by growing the heap */
+    unsigned long long huge_mallocs; /* by a mapping of their own */
+
+    /* how blocks were freed */
+    unsigned long long frees;
+    unsigned long long tcache_puts;  /* into the thread cache */
+    unsigned long long quick_puts;   /* onto the quick list of their size */
+    unsigned long long remote_frees; /* onto another arena's remote stack */
+    unsigned long long reallocs;
+    unsigned long long realloc_moves; /* reallocs that moved the payload */
+
+    /* the work behind them */
+    unsigned long long searches;     /* scans of the bin of a request */
+    unsigned long long scanned;      /* free blocks looked at by them */
+    unsigned long long splits;       /* blocks split in two */
+    unsigned long long coalesces;    /* free blocks merged with a neighbor */
+    unsigned long long quick_flushes; /* quick lists freed in a batch */
+    unsigned long long sbrks;        /* calls to mem_region_sbrk */
+    unsigned long long trims;        /* ... that gave memory back */
+} mm_stats_t;
+
+extern void mm_stats(mm_stats_t *stats);
+
+/*
+ * Gives the calling thread's cached blocks back to the heap, and the free
+ * space at the end of the heap back to the simulated memory.
+ */
+extern void mm_trim(void);
+
+/*
+ * Checks the consistency of the whole heap, reporting each problem found on
+ * stderr. Returns nonzero if the heap is consistent.
+ */
+extern int mm_check(void);
+
 /*
  * Students work in teams of one.  Teams enter their
  * personal name and student ID in a struct of this
@@ -0,0 +1,129 @@
+/*
+ * perf.c - Count hardware events used by a function f
+ *
+ * The counters come from Linux's perf_event_open. Each event has a
+ * counter of its own, so that the ones the machine lacks, or that the
+ * kernel does not let us use, can be left out while the rest still
+ * count. Counts are scaled up when the kernel had to multiplex the
+ * counters. Elsewhere, and when no counter opens, nothing is counted.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "perf.h"
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+/* Cache event config for a read miss at the given cache */
+#define CACHE_MISS(cache) ((cache) | PERF_COUNT_HW_CACHE_OP_READ << 8 | \
+                           PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+
+static const struct {
+    const char *name;
+    unsigned type;
+    unsigned long long config;
+} events[PERF_EVENTS] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instrs", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"L1d", PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_L1D)},
+    {"LLC", PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_LL)},
+    {"dTLB", PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_DTLB)},
+    {"branch", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+static int fds[PERF_EVENTS];
+static int opened = 0;  /* has init_perf run? */
+
+/*
+ * init_perf - Open the counters; returns how many of them are available
+ */
+int init_perf(void)
+{
+    struct perf_event_attr attr;
+    int i, n = 0;
+
+    if (opened)
+        for (i = 0; i < PERF_EVENTS; i++)
+            if (fds[i] >= 0)
+                close(fds[i]);
+    for (i = 0; i < PERF_EVENTS; i++) {
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;  /* allowed at perf_event_paranoid 2 */
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+            PERF_FORMAT_TOTAL_TIME_RUNNING;
+        fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        n += (fds[i] >= 0);
+    }
+    opened = 1;
+    return n;
+}
+
+/*
+ * perf_name - Short name of event i
+ */
+const char *perf_name(int i)
+{
+    return events[i].name;
+}
+
+/*
+ * perf_measure - Count the events used by f(argp), or -1 for
+ *     unavailable ones
+ */
+void perf_measure(perf_test_funct f, void *argp, double *counts)
+{
+    unsigned long long val[3];  /* count, time enabled, time running */
+    int i;
+
+    for (i = 0; i < PERF_EVENTS; i++)
+        if (opened && fds[i] >= 0) {
+            ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    f(argp);
+    for (i = 0; i < PERF_EVENTS; i++)
+        if (opened && fds[i] >= 0)
+            ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+
+    for (i = 0; i < PERF_EVENTS; i++) {
+        counts[i] = -1;
+        if (!opened || fds[i] < 0 ||
+            read(fds[i], val, sizeof(val)) != sizeof(val) || val[2] == 0)
+            continue;
+        counts[i] = (double)val[0] * ((double)val[1] / val[2]);
+    }
+}
+
+#else /* !__linux__ */
+
+int init_perf(void)
+{
+    return 0;
+}
+
+const char *perf_name(int i)
+{
+    static const char *names[PERF_EVENTS] = {
+        "cycles", "instrs", "L1d", "LLC", "dTLB", "branch"
+    };
+    return names[i];
+}
+
+void perf_measure(perf_test_funct f, void *argp, double *counts)
+{
+    int i;
+
+    f(argp);
+    for (i = 0; i < PERF_EVENTS; i++)
+        counts[i] = -1;
+}
+
+#endif /* __linux__ */
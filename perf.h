@@ -0,0 +1,19 @@
+/*
+ * perf.h - Count hardware events used by a function f
+ */
+typedef void (*perf_test_funct)(void *);
+
+/* The events counted, in the order of perf_measure's counts */
+enum {
+    PERF_CYCLES, PERF_INSTRUCTIONS, PERF_L1D_MISSES, PERF_LLC_MISSES,
+    PERF_DTLB_MISSES, PERF_BRANCH_MISSES, PERF_EVENTS
+};
+
+/* Open the counters; returns how many of them are available */
+int init_perf(void);
+
+/* Short name of event i */
+const char *perf_name(int i);
+
+/* Count the events used by f(argp), or -1 for unavailable ones */
+void perf_measure(perf_test_funct f, void *argp, double *counts);
@@ -0,0 +1,279 @@
+/*
+ * range.c - an index of the payload ranges of allocated blocks.
+ *
+ * Ranges are kept in a treap ordered by their low address, which finds
+ * an overlapping range in O(log n): as recorded ranges never overlap, a
+ * range overlaps lo:hi if and only if the one with the highest low
+ * address at most hi does. They are also kept in a chained hash table
+ * keyed by their low address, so that a range is found in O(1) when its
+ * block is freed. Each range_t is embedded at the start of a node that
+ * also holds the links of both structures and a pointer to the index.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "mm.h"
+#include "range.h"
+
+#define MIN_BUCKETS 64
+
+typedef struct range_index range_index_t;
+
+/* A recorded range, with its treap and hash chain links */
+typedef struct range_node {
+    range_t range;                 /* must be first */
+    range_index_t *index;
+    struct range_node *left;       /* treap children */
+    struct range_node *right;
+    struct range_node *chain;      /* next node in the same bucket */
+} range_node_t;
+
+struct range_index {
+    range_node_t *root;            /* treap root */
+    range_node_t **buckets;        /* hash table */
+    size_t nbuckets;               /* a power of two */
+    size_t count;                  /* number of ranges */
+};
+
+/*
+ * range_hash - mix the bits of an address, which are otherwise mostly
+ *     equal at both ends
+ */
+static uint64_t range_hash(char *lo)
+{
+    uint64_t h = (uintptr_t)lo >> 4;
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/*
+ * range_prio - treap priority of a node, from the other end of its hash
+ */
+static unsigned int range_prio(range_node_t *node)
+{
+    return (unsigned int)(range_hash(node->range.lo) >> 32);
+}
+
+/*
+ * range_index - the index behind a range list, or NULL if it is empty
+ */
+static range_index_t *range_index(range_t **ranges)
+{
+    return *ranges ? ((range_node_t *)*ranges)->index : NULL;
+}
+
+/*
+ * range_update - point the range list at the treap root, or set it to
+ *     NULL and free the index once it is empty
+ */
+static void range_update(range_t **ranges, range_index_t *index)
+{
+    if (index->count == 0) {
+        free(index->buckets);
+        free(index);
+        *ranges = NULL;
+    } else {
+        *ranges = &index->root->range;
+    }
+}
+
+/*
+ * range_grow - double the number of hash buckets
+ */
+static void range_grow(range_index_t *index)
+{
+    size_t n = index->nbuckets * 2, i;
+    range_node_t **buckets = calloc(n, sizeof(range_node_t *));
+    range_node_t *node, *next;
+
+    if (buckets == NULL) {
+        fprintf(stderr, "ERROR: range_grow failed. Ran out of memory...\n");
+        exit(1);
+    }
+    for (i = 0; i < index->nbuckets; i++) {
+        for (node = index->buckets[i]; node != NULL; node = next) {
+            size_t b = range_hash(node->range.lo) & (n-1);
+            next = node->chain;
+            node->chain = buckets[b];
+            buckets[b] = node;
+        }
+    }
+    free(index->buckets);
+    index->buckets = buckets;
+    index->nbuckets = n;
+}
+
+/*
+ * treap_insert - insert a node into the treap rooted at *link, as a
+ *     leaf, rotating it up as long as its priority is higher than its
+ *     parent's
+ */
+static void treap_insert(range_node_t **link, range_node_t *node)
+{
+    range_node_t *root = *link, *child;
+
+    if (root == NULL) {
+        node->left = node->right = NULL;
+        *link = node;
+        return;
+    }
+
+    if (node->range.lo < root->range.lo) {
+        treap_insert(&root->left, node);
+        child = root->left;
+        if (range_prio(child) > range_prio(root)) {
+            root->left = child->right;
+            child->right = root;
+            *link = child;
+        }
+    } else {
+        treap_insert(&root->right, node);
+        child = root->right;
+        if (range_prio(child) > range_prio(root)) {
+            root->right = child->left;
+            child->left = root;
+            *link = child;
+        }
+    }
+}
+
+/*
+ * treap_remove - remove a node from the treap rooted at *link, rotating
+ *     it down until it has at most one child, which takes its place
+ */
+static void treap_remove(range_node_t **link, range_node_t *node)
+{
+    while (*link != node)
+        link = node->range.lo < (*link)->range.lo ?
+            &(*link)->left : &(*link)->right;
+
+    while (node->left && node->right) {
+        range_node_t *left = node->left, *right = node->right;
+        if (range_prio(left) > range_prio(right)) {
+            node->left = left->right;
+            left->right = node;
+            *link = left;
+            link = &left->right;
+        } else {
+            node->right = right->left;
+            right->left = node;
+            *link = right;
+            link = &right->left;
+        }
+    }
+    *link = node->left ? node->left : node->right;
+}
+
+/*
+ * find_range - return a recorded range that overlaps lo:hi, or NULL
+ */
+range_t *find_range(range_t **ranges, char *lo, char *hi)
+{
+    range_index_t *index = range_index(ranges);
+    range_node_t *node, *best = NULL;
+
+    if (index == NULL)
+        return NULL;
+
+    /* the range with the highest low address at most hi */
+    for (node = index->root; node != NULL; ) {
+        if (node->range.lo <= hi) {
+            best = node;
+            node = node->right;
+        } else {
+            node = node->left;
+        }
+    }
+    return (best != NULL && best->range.hi >= lo) ? &best->range : NULL;
+}
+
+/*
+ * insert_range - record the range lo:hi
+ */
+void insert_range(range_t **ranges, char *lo, char *hi)
+{
+    range_index_t *index = range_index(ranges);
+    range_node_t *node;
+    size_t b;
+
+    if (index == NULL) {
+        if ((index = calloc(1, sizeof(range_index_t))) == NULL ||
+            (index->buckets = calloc(MIN_BUCKETS,
+                                     sizeof(range_node_t *))) == NULL) {
+            fprintf(stderr, "ERROR: insert_range failed. "
+                    "Ran out of memory...\n");
+            exit(1);
+        }
+        index->nbuckets = MIN_BUCKETS;
+    }
+    if ((node = malloc(sizeof(range_node_t))) == NULL) {
+        fprintf(stderr, "ERROR: insert_range failed. Ran out of memory...\n");
+        exit(1);
+    }
+    node->range.lo = lo;
+    node->range.hi = hi;
+    node->range.next = NULL;
+    node->index = index;
+
+    if (index->count >= index->nbuckets)
+        range_grow(index);
+    b = range_hash(lo) & (index->nbuckets-1);
+    node->chain = index->buckets[b];
+    index->buckets[b] = node;
+
+    treap_insert(&index->root, node);
+    index->count++;
+    range_update(ranges, index);
+}
+
+/*
+ * remove_range - forget the range that starts at lo
+ */
+void remove_range(range_t **ranges, char *lo)
+{
+    range_index_t *index;
+    range_node_t *node, **prevpp;
+
+    if (!ranges || (index = range_index(ranges)) == NULL)
+        return;
+
+    prevpp = &index->buckets[range_hash(lo) & (index->nbuckets-1)];
+    for (node = *prevpp; node != NULL; node = node->chain) {
+        if (node->range.lo == lo)
+            break;
+        prevpp = &node->chain;
+    }
+    if (node == NULL)
+        return;
+
+    *prevpp = node->chain;
+    treap_remove(&index->root, node);
+    free(node);
+    index->count--;
+    range_update(ranges, index);
+}
+
+/*
+ * clear_ranges - forget all ranges
+ */
+void clear_ranges(range_t **ranges)
+{
+    range_index_t *index = range_index(ranges);
+    range_node_t *node, *next;
+    size_t i;
+
+    if (index == NULL)
+        return;
+    for (i = 0; i < index->nbuckets; i++) {
+        for (node = index->buckets[i]; node != NULL; node = next) {
+            next = node->chain;
+            free(node);
+        }
+    }
+    index->count = 0;
+    range_update(ranges, index);
+}
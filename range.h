@@ -0,0 +1,24 @@
+/*
+ * range.h - an index of the payload ranges of allocated blocks, used by
+ *     the driver (and by mm_free through the range list it is given) to
+ *     check that no two payloads overlap; include it after mm.h, which
+ *     defines range_t
+ */
+
+/*
+ * The index hides behind the range_t API: *ranges is NULL when no range
+ * is recorded, and otherwise points to one of the recorded ranges, from
+ * which the index itself is found. The next field is unused.
+ */
+
+/* Return a recorded range that overlaps lo:hi, or NULL if there is none */
+range_t *find_range(range_t **ranges, char *lo, char *hi);
+
+/* Record the range lo:hi, which must not overlap a recorded range */
+void insert_range(range_t **ranges, char *lo, char *hi);
+
+/* Forget the range that starts at lo, if there is one */
+void remove_range(range_t **ranges, char *lo);
+
+/* Forget all ranges */
+void clear_ranges(range_t **ranges);
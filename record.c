@@ -0,0 +1,637 @@
+/*
+ * record.c - Record the allocation requests of a program as a trace file
+ *
+ * Build librecord.so and preload it:
+ *
+ *   $ MM_RECORD=app.bin LD_PRELOAD=./librecord.so app ...
+ *
+ * malloc, calloc, realloc, free and the aligned allocators are passed
+ * on to the C library, and recorded as requests on dense block ids,
+ * which are reused once their blocks are freed. The trace goes to
+ * $MM_RECORD, or mm-record.bin by default: in the text format if the
+ * name ends in .rep, and in the binary format otherwise.
+ *
+ * Live pointers are mapped to ids by a hash table split into shards,
+ * each under its own lock, so that threads rarely wait on each other.
+ * Each request gets a sequence number while the lock of its pointer
+ * is held, which orders it after every request it depends on. Each
+ * thread buffers its requests and spills them to a spool file of its
+ * own; when the program exits, the spools are merged by sequence
+ * number into the trace, which read_trace can then load. Each buffer
+ * has a lock of its own, which only its thread takes until then, so
+ * that the exiting thread can spill it safely.
+ *
+ * mdriver cannot replay a request for 0 bytes, so malloc(0) and the
+ * like are recorded as requests for 1 byte.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "trace.h"
+
+#define NSHARDS     64      /* shards of the pointer map */
+#define MIN_SLOTS   1024    /* initial slots of each shard */
+#define BUF_RECS    4096    /* requests buffered per thread */
+#define BOOT_BYTES  4096    /* memory for allocations made by dlsym */
+
+/* A recorded request, as spooled */
+typedef struct {
+  uint64_t seq;     /* order of the request in the trace */
+  uint32_t type;
+  uint32_t id;
+  uint64_t size;
+} rec_t;
+
+/* A live pointer and its id */
+typedef struct {
+  uintptr_t key;    /* 0 if the slot is empty */
+  unsigned id;
+} slot_t;
+
+/* One shard of the pointer map: an open-addressed hash table */
+typedef struct {
+  int lock __attribute__((aligned(64)));
+  slot_t *slots;
+  size_t nslots;    /* a power of two */
+  size_t count;
+} shard_t;
+
+/* The requests of one thread */
+typedef struct thread_buf {
+  int lock;                     /* taken by record and record_exit */
+  rec_t *recs;                  /* BUF_RECS of them */
+  int n;
+  int fd;                       /* the spool file */
+  struct thread_buf *next;      /* next in the list of all buffers */
+} thread_buf_t;
+
+/* The C library's functions */
+static void *(*real_malloc)(size_t);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_realloc)(void *, size_t);
+static void (*real_free)(void *);
+static int (*real_posix_memalign)(void **, size_t, size_t);
+static void *(*real_aligned_alloc)(size_t, size_t);
+static void *(*real_memalign)(size_t, size_t);
+
+static char boot[BOOT_BYTES];   /* memory handed out while dlsym runs */
+static size_t boot_used;
+
+static shard_t shards[NSHARDS];
+static uint64_t next_seq;       /* sequence number of the next request */
+
+static int ids_lock;            /* guards the free ids and num_ids */
+static unsigned *free_ids;      /* ids of freed blocks, a stack */
+static size_t nfree_ids, free_ids_cap;
+static unsigned num_ids;
+
+static int bufs_lock;           /* guards the list of buffers */
+static thread_buf_t *bufs;
+static int nspools;
+
+static char path[PATH_MAX];     /* the trace file */
+static volatile int active;     /* recording? */
+static __thread int busy;       /* inside the recorder? */
+static __thread thread_buf_t *tbuf;
+
+/*
+ * spin_lock, spin_unlock - the recorder cannot use mutexes that might
+ *     allocate, so it spins
+ */
+static void spin_lock(int *lock)
+{
+  int spins = 0;
+
+  while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE))
+    if (++spins % 64 == 0)
+      sched_yield();
+}
+
+static void spin_unlock(int *lock)
+{
+  __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * map_pages - get zeroed memory for the recorder, which must not come
+ *     from the allocator being recorded
+ */
+static void *map_pages(size_t bytes)
+{
+  void *p = mmap(NULL, bytes, PROT_READ|PROT_WRITE,
+      MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+
+  if (p == MAP_FAILED) {
+    static const char msg[] = "librecord: out of memory\n";
+    write(2, msg, sizeof(msg) - 1);
+    _exit(1);
+  }
+  return p;
+}
+
+/*
+ * ptr_hash - mix the bits of a pointer, whose low bits are mostly zero
+ */
+static size_t ptr_hash(uintptr_t key)
+{
+  uint64_t h = key >> 4;
+
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return h;
+}
+
+/*
+ * shard_of - the shard that holds pointer key
+ */
+static shard_t *shard_of(uintptr_t key)
+{
+  return &shards[(ptr_hash(key) >> 40) % NSHARDS];
+}
+
+/*
+ * map_insert - Map key to id in shard s, growing it as needed
+ */
+static void map_insert(shard_t *s, uintptr_t key, unsigned id)
+{
+  slot_t *old = s->slots;
+  size_t i, oldn = s->nslots;
+
+  if (2 * (s->count + 1) > s->nslots) {
+    s->nslots = oldn ? 2 * oldn : MIN_SLOTS;
+    s->slots = map_pages(s->nslots * sizeof(slot_t));
+    s->count = 0;
+    for (i = 0; i < oldn; i++)
+      if (old[i].key)
+        map_insert(s, old[i].key, old[i].id);
+    if (old)
+      munmap(old, oldn * sizeof(slot_t));
+  }
+  for (i = ptr_hash(key) & (s->nslots - 1); s->slots[i].key;
+      i = (i + 1) & (s->nslots - 1))
+    if (s->slots[i].key == key)
+      break;
+  s->count += (s->slots[i].key == 0);
+  s->slots[i].key = key;
+  s->slots[i].id = id;
+}
+
+/*
+ * map_remove - Unmap key in shard s, and return its id in *id; returns
+ *     0 if key was not mapped
+ */
+static int map_remove(shard_t *s, uintptr_t key, unsigned *id)
+{
+  size_t i, j, home, mask = s->nslots - 1;
+
+  if (s->nslots == 0)
+    return 0;
+  for (i = ptr_hash(key) & mask; s->slots[i].key != key; i = (i + 1) & mask)
+    if (s->slots[i].key == 0)
+      return 0;
+  *id = s->slots[i].id;
+  s->count--;
+
+  /* Shift back the slots after it that would no longer be found */
+  for (j = (i + 1) & mask; s->slots[j].key; j = (j + 1) & mask) {
+    home = ptr_hash(s->slots[j].key) & mask;
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      s->slots[i] = s->slots[j];
+      i = j;
+    }
+  }
+  s->slots[i].key = 0;
+  return 1;
+}
+
+/*
+ * new_id, put_id - take an id for a new block, and give back the id
+ *     of a freed one
+ */
+static unsigned new_id(void)
+{
+  unsigned id;
+
+  spin_lock(&ids_lock);
+  id = nfree_ids ? free_ids[--nfree_ids] : num_ids++;
+  spin_unlock(&ids_lock);
+  return id;
+}
+
+static void put_id(unsigned id)
+{
+  unsigned *grown;
+
+  spin_lock(&ids_lock);
+  if (nfree_ids == free_ids_cap) {
+    grown = map_pages((free_ids_cap ? 2 * free_ids_cap : 1024) *
+        sizeof(unsigned));
+    if (free_ids) {
+      memcpy(grown, free_ids, nfree_ids * sizeof(unsigned));
+      munmap(free_ids, free_ids_cap * sizeof(unsigned));
+    }
+    free_ids = grown;
+    free_ids_cap = free_ids_cap ? 2 * free_ids_cap : 1024;
+  }
+  free_ids[nfree_ids++] = id;
+  spin_unlock(&ids_lock);
+}
+
+/*
+ * spill - Write the buffered requests of a thread to its spool
+ */
+static void spill(thread_buf_t *b)
+{
+  char *p = (char *)b->recs;
+  size_t left = b->n * sizeof(rec_t);
+  ssize_t n;
+
+  while (left > 0 && (n = write(b->fd, p, left)) > 0) {
+    p += n;
+    left -= n;
+  }
+  b->n = 0;
+}
+
+/*
+ * thread_buf - the buffer of the calling thread, set up on first use
+ */
+static thread_buf_t *thread_buf(void)
+{
+  char name[PATH_MAX + 32];
+  thread_buf_t *b;
+
+  if (tbuf)
+    return tbuf;
+  b = map_pages(sizeof(thread_buf_t) + BUF_RECS * sizeof(rec_t));
+  b->recs = (rec_t *)(b + 1);
+  spin_lock(&bufs_lock);
+  snprintf(name, sizeof(name), "%s.%d.spool", path, nspools++);
+  b->fd = open(name, O_RDWR|O_CREAT|O_TRUNC, 0600);
+  b->next = bufs;
+  bufs = b;
+  spin_unlock(&bufs_lock);
+  if (b->fd < 0) {
+    static const char msg[] = "librecord: cannot create a spool file\n";
+    write(2, msg, sizeof(msg) - 1);
+    _exit(1);
+  }
+  return tbuf = b;
+}
+
+/*
+ * record - Buffer a request; the caller holds the lock of the shard of
+ *     its pointer, which orders it after the requests it depends on.
+ *     Requests made once record_exit has begun are dropped.
+ */
+static void record(int type, unsigned id, size_t size)
+{
+  thread_buf_t *b;
+  rec_t *r;
+
+  if (!active)
+    return;
+  b = thread_buf();
+  spin_lock(&b->lock);
+  if (active) {
+    r = &b->recs[b->n++];
+    r->seq = __atomic_fetch_add(&next_seq, 1, __ATOMIC_RELAXED);
+    r->type = type;
+    r->id = id;
+    r->size = (size > INT_MAX) ? INT_MAX : size;
+    if (b->n == BUF_RECS)
+      spill(b);
+  }
+  spin_unlock(&b->lock);
+}
+
+/*
+ * record_alloc - Record a new block p of size bytes, or of 1 byte if
+ *     size is 0
+ */
+static void record_alloc(void *p, size_t size)
+{
+  shard_t *s = shard_of((uintptr_t)p);
+  unsigned id = new_id();
+
+  spin_lock(&s->lock);
+  map_insert(s, (uintptr_t)p, id);
+  record(ALLOC, id, size ? size : 1);
+  spin_unlock(&s->lock);
+}
+
+/*
+ * record_free - Record that block p is being freed; returns 0 if p was
+ *     not recorded
+ */
+static int record_free(void *p)
+{
+  shard_t *s = shard_of((uintptr_t)p);
+  unsigned id;
+
+  spin_lock(&s->lock);
+  if (!map_remove(s, (uintptr_t)p, &id)) {
+    spin_unlock(&s->lock);
+    return 0;
+  }
+  record(FREE, id, 0);
+  spin_unlock(&s->lock);
+  put_id(id);
+  return 1;
+}
+
+/*
+ * setup - Find the C library's functions, and start recording
+ */
+static void setup(void)
+{
+  const char *name;
+
+  busy++;
+  real_malloc = dlsym(RTLD_NEXT, "malloc");
+  real_calloc = dlsym(RTLD_NEXT, "calloc");
+  real_realloc = dlsym(RTLD_NEXT, "realloc");
+  real_free = dlsym(RTLD_NEXT, "free");
+  real_posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+  real_aligned_alloc = dlsym(RTLD_NEXT, "aligned_alloc");
+  real_memalign = dlsym(RTLD_NEXT, "memalign");
+  busy--;
+
+  if ((name = getenv("MM_RECORD")) == NULL || !*name)
+    name = "mm-record.bin";
+  snprintf(path, sizeof(path), "%s", name);
+  active = 1;
+}
+
+/* A forked child must not write to its parent's spools */
+static void stop_in_child(void)
+{
+  active = 0;
+}
+
+__attribute__((constructor))
+static void record_init(void)
+{
+  if (!real_malloc)
+    setup();
+  pthread_atfork(NULL, NULL, stop_in_child);
+}
+
+/* The head of a spool, in the merge heap */
+typedef struct {
+  rec_t *next, *end;
+} spool_t;
+
+/*
+ * sift_down - Restore the heap order of the spools below position i
+ */
+static void sift_down(spool_t *heap, int n, int i)
+{
+  spool_t tmp;
+  int c;
+
+  while ((c = 2 * i + 1) < n) {
+    if (c + 1 < n && heap[c + 1].next->seq < heap[c].next->seq)
+      c++;
+    if (heap[i].next->seq <= heap[c].next->seq)
+      break;
+    tmp = heap[i];
+    heap[i] = heap[c];
+    heap[c] = tmp;
+    i = c;
+  }
+}
+
+/*
+ * record_exit - Stop recording, and merge the spools into the trace.
+ *     Other threads may still be running, so each buffer is spilled
+ *     under its lock; they record nothing more once they see that
+ *     recording has stopped.
+ */
+__attribute__((destructor))
+static void record_exit(void)
+{
+  char name[PATH_MAX + 32];
+  thread_buf_t *b;
+  spool_t *heap;
+  struct stat st;
+  unsigned prev = 0;
+  unsigned long long num_ops = 0;
+  int binary, i, n = 0;
+  size_t len;
+  rec_t *r;
+  FILE *out;
+
+  if (!active)
+    return;
+  busy++;
+  active = 0;
+
+  /* Spill every buffer, and map every spool */
+  spin_lock(&bufs_lock);
+  heap = map_pages((nspools + 1) * sizeof(spool_t));
+  for (b = bufs; b; b = b->next) {
+    spin_lock(&b->lock);
+    spill(b);
+    spin_unlock(&b->lock);
+    if (fstat(b->fd, &st) == 0 && st.st_size > 0) {
+      heap[n].next = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, b->fd, 0);
+      if (heap[n].next != MAP_FAILED) {
+        heap[n].end = heap[n].next + st.st_size / sizeof(rec_t);
+        num_ops += heap[n].end - heap[n].next;
+        n++;
+      }
+    }
+    close(b->fd);
+  }
+  for (i = 0; i < nspools; i++) {
+    snprintf(name, sizeof(name), "%s.%d.spool", path, i);
+    unlink(name);
+  }
+  spin_unlock(&bufs_lock);
+
+  if ((out = fopen(path, "w")) == NULL) {
+    fprintf(stderr, "librecord: cannot write %s\n", path);
+    return;
+  }
+  if (num_ops > INT_MAX || num_ids > TRACE_MAX_IDS)
+    fprintf(stderr, "librecord: %s has too many requests for mdriver\n",
+        path);
+
+  /* Merge the spools by sequence number */
+  len = strlen(path);
+  binary = !(len >= 4 && !strcmp(path + len - 4, ".rep"));
+  if (binary)
+    trace_put_header(out, 0, num_ids, num_ops, 1);
+  else
+    fprintf(out, "0\n%u\n%llu\n1\n", num_ids, num_ops);
+  for (i = n / 2 - 1; i >= 0; i--)
+    sift_down(heap, n, i);
+  while (n > 0) {
+    r = heap[0].next++;
+    if (binary)
+      trace_put_op(out, &prev, r->type, r->id, r->size);
+    else if (r->type == FREE)
+      fprintf(out, "f %u\n", r->id);
+    else
+      fprintf(out, "%c %u %llu\n", (r->type == ALLOC) ? 'a' : 'r', r->id,
+          (unsigned long long)r->size);
+    if (heap[0].next == heap[0].end)
+      heap[0] = heap[--n];
+    sift_down(heap, n, 0);
+  }
+  fclose(out);
+}
+
+/*********************************************************
+ * The interposed functions, which record only when called
+ * from outside the recorder while it is active
+ ********************************************************/
+
+void *malloc(size_t size)
+{
+  void *p;
+
+  if (!real_malloc)
+    setup();
+  p = real_malloc(size);
+  if (p && active && !busy) {
+    busy++;
+    record_alloc(p, size);
+    busy--;
+  }
+  return p;
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+  void *p;
+
+  /* dlsym allocates with calloc before there is a calloc to call */
+  if (!real_calloc) {
+    size_t bytes = (nmemb * size + 15) & ~(size_t)15;
+    if (nmemb && size > BOOT_BYTES / nmemb) /* also catches overflow */
+      return NULL;
+    if (boot_used + bytes > BOOT_BYTES)
+      return NULL;
+    p = boot + boot_used;
+    boot_used += bytes;
+    return p;
+  }
+  p = real_calloc(nmemb, size);
+  if (p && active && !busy) {
+    busy++;
+    record_alloc(p, nmemb * size);
+    busy--;
+  }
+  return p;
+}
+
+void free(void *ptr)
+{
+  if (ptr == NULL || ((char *)ptr >= boot && (char *)ptr < boot + BOOT_BYTES))
+    return;
+  if (!real_free)
+    setup();
+  if (active && !busy) {
+    busy++;
+    record_free(ptr);
+    busy--;
+  }
+  real_free(ptr);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+  shard_t *s;
+  unsigned id;
+  void *p;
+  int known = 0;
+
+  if (!real_realloc)
+    setup();
+  if (ptr == NULL)
+    return malloc(size);
+  if (!active || busy)
+    return real_realloc(ptr, size);
+  busy++;
+
+  /* Take the old pointer out of the map before another thread reuses it */
+  s = shard_of((uintptr_t)ptr);
+  spin_lock(&s->lock);
+  known = map_remove(s, (uintptr_t)ptr, &id);
+  if (known && size == 0)
+    record(FREE, id, 0);
+  spin_unlock(&s->lock);
+  if (known && size == 0)
+    put_id(id);
+
+  p = real_realloc(ptr, size);
+  if (known && size != 0) {
+    /* A failed realloc leaves the block where it was */
+    s = shard_of((uintptr_t)(p ? p : ptr));
+    spin_lock(&s->lock);
+    map_insert(s, (uintptr_t)(p ? p : ptr), id);
+    if (p)
+      record(REALLOC, id, size);
+    spin_unlock(&s->lock);
+  }
+  busy--;
+  return p;
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+  int err;
+
+  if (!real_posix_memalign)
+    setup();
+  err = real_posix_memalign(memptr, alignment, size);
+  if (err == 0 && active && !busy) {
+    busy++;
+    record_alloc(*memptr, size);
+    busy--;
+  }
+  return err;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+  void *p;
+
+  if (!real_aligned_alloc)
+    setup();
+  p = real_aligned_alloc(alignment, size);
+  if (p && active && !busy) {
+    busy++;
+    record_alloc(p, size);
+    busy--;
+  }
+  return p;
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+  void *p;
+
+  if (!real_memalign)
+    setup();
+  p = real_memalign(alignment, size);
+  if (p && active && !busy) {
+    busy++;
+    record_alloc(p, size);
+    busy--;
+  }
+  return p;
+}
@@ -0,0 +1,48 @@
+/*
+ * rep2bin.c - Convert a trace file to the binary trace format
+ *
+ * Usage: rep2bin <in.rep> <out>
+ *
+ * The input may be in either format, so the program also copies binary
+ * traces. See trace.h for the layout of the output.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "trace.h"
+
+int main(int argc, char **argv)
+{
+  trace_t *trace;
+  traceop_t *op;
+  FILE *out;
+  unsigned prev = 0;
+  int i;
+
+  if (argc != 3) {
+    fprintf(stderr, "Usage: %s <in.rep> <out>\n", argv[0]);
+    exit(1);
+  }
+
+  trace = read_trace("", argv[1]);
+  if ((out = fopen(argv[2], "wb")) == NULL) {
+    printf("Could not open %s: %s\n", argv[2], strerror(errno));
+    exit(1);
+  }
+
+  trace_put_header(out, trace->sugg_heapsize, trace->num_ids,
+      trace->num_ops, trace->weight);
+  for (i = 0;  i < trace->num_ops;  i++) {
+    op = TRACE_OP(trace, i);
+    trace_put_op(out, &prev, op->type, op->index, op->size);
+  }
+
+  if (ferror(out) || fclose(out) == EOF) {
+    printf("Could not write %s: %s\n", argv[2], strerror(errno));
+    exit(1);
+  }
+  free_trace(trace);
+  return 0;
+}
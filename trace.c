@@ -0,0 +1,370 @@
+/*
+ * trace.c - loading and writing of allocator trace files.
+ *
+ * Both text and binary traces are mapped rather than read, and decoded
+ * in place, so that loading a trace of millions of requests stays
+ * cheaper than replaying it. Malformed input is reported with its line
+ * (or, in a binary trace, its byte offset) and ends the run.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "trace.h"
+
+#define HDRWORDS 4 /* number of words in a trace header */
+
+/* Is c a white space character? */
+#define IS_SPACE(c) ((c) == ' ' || (unsigned)((c) - '\t') <= '\r' - '\t')
+
+/*
+ * trace_error - Report a malformed trace file, naming the place at p
+ */
+static void trace_error(trace_t *trace, const char *p, const char *what)
+{
+  const char *q;
+  int line = 1;
+
+  if (trace->binary) {
+    printf("%s: offset %ld: %s\n", trace->path, (long)(p - trace->base),
+        what);
+  } else {
+    for (q = trace->base; q < p; q++)
+      line += (*q == '\n');
+    printf("%s:%d: %s\n", trace->path, line, what);
+  }
+  exit(1);
+}
+
+/*
+ * trace_unix_error - Report a failed system call on a trace file
+ */
+static void trace_unix_error(const char *path, const char *what)
+{
+  printf("%s %s in read_trace: %s\n", what, path, strerror(errno));
+  exit(1);
+}
+
+/*
+ * trace_uint - Skip leading white space and scan the decimal integer
+ *     that follows, which must not exceed INT_MAX. Returns the first
+ *     character after it, or NULL if there is no such integer.
+ */
+static const char *trace_uint(const char *p, const char *end, unsigned *val)
+{
+  const char *start;
+  unsigned v = 0;
+
+  while (p < end && IS_SPACE(*p))
+    p++;
+  for (start = p; p < end && (unsigned)(*p - '0') < 10; p++) {
+    v = v * 10 + (*p - '0');
+    if (v > INT_MAX)
+      return NULL;
+  }
+  if (p == start)
+    return NULL;
+  *val = v;
+  return p;
+}
+
+/*
+ * trace_varint - Decode the varint at p, which must not exceed INT_MAX.
+ *     Returns the first byte after it, or NULL if it is malformed.
+ */
+static const char *trace_varint(const char *p, const char *end, unsigned *val)
+{
+  unsigned v = 0;
+  int shift;
+
+  for (shift = 0; p < end && shift < 32; shift += 7) {
+    v |= (unsigned)(*p & 0x7f) << shift;
+    if (!(*p++ & 0x80)) {
+      if (v > INT_MAX)
+        return NULL;
+      *val = v;
+      return p;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * trace_get_u32 - Decode the little-endian word at p
+ */
+static unsigned trace_get_u32(const char *p)
+{
+  const unsigned char *b = (const unsigned char *)p;
+
+  return b[0] | b[1] << 8 | b[2] << 16 | (unsigned)b[3] << 24;
+}
+
+/*
+ * trace_decode_text - Decode the next n requests of a text trace
+ */
+static void trace_decode_text(trace_t *trace, int n)
+{
+  const char *p = trace->next, *end = trace->end, *line;
+  traceop_t *op;
+  unsigned index, size;
+  char bogus[32];
+
+  for (op = trace->ops; op < trace->ops + n; op++) {
+    while (p < end && IS_SPACE(*p))
+      p++;
+    if ((line = p) == end)
+      trace_error(trace, p, "fewer requests than the header says");
+    switch (*p) {
+      case 'a':
+      case 'r':
+        op->type = (*p == 'a') ? ALLOC : REALLOC;
+        for (p++; p < end && *p > ' '; p++)
+          ;
+        if ((p = trace_uint(p, end, &index)) == NULL ||
+            (p = trace_uint(p, end, &size)) == NULL)
+          trace_error(trace, line, "failed to read request");
+        op->size = size;
+        break;
+      case 'f':
+        op->type = FREE;
+        for (p++; p < end && *p > ' '; p++)
+          ;
+        if ((p = trace_uint(p, end, &index)) == NULL)
+          trace_error(trace, line, "failed to read request");
+        op->size = 0;
+        break;
+      default:
+        snprintf(bogus, sizeof(bogus), "bogus type character (%c)", *p);
+        trace_error(trace, line, bogus);
+    }
+    if (index >= (unsigned)trace->num_ids)
+      trace_error(trace, line, "block id out of range");
+    op->index = index;
+  }
+  trace->next = p;
+}
+
+/*
+ * trace_decode_bin - Decode the next n requests of a binary trace
+ */
+static void trace_decode_bin(trace_t *trace, int n)
+{
+  const char *p = trace->next, *end = trace->end, *start;
+  traceop_t *op;
+  unsigned index = trace->prev, zz, size;
+
+  for (op = trace->ops; op < trace->ops + n; op++) {
+    if ((start = p) == end)
+      trace_error(trace, p, "fewer requests than the header says");
+    if ((unsigned char)*p >> 4 > REALLOC)
+      trace_error(trace, start, "bad request type");
+    op->type = (unsigned char)*p >> 4;
+    zz = *p++ & 0xf;
+    if (zz == TRACE_DELTA_ESC && (p = trace_varint(p, end, &zz)) == NULL)
+      trace_error(trace, start, "failed to read request");
+    index += (zz >> 1) ^ -(zz & 1);
+    if (index >= (unsigned)trace->num_ids)
+      trace_error(trace, start, "block id out of range");
+    op->index = index;
+    size = 0;
+    if (op->type != FREE && (p = trace_varint(p, end, &size)) == NULL)
+      trace_error(trace, start, "failed to read request");
+    op->size = size;
+  }
+  trace->next = p;
+  trace->prev = index;
+}
+
+/*
+ * trace_fill - Decode the requests from op i on into trace->ops, and
+ *     return the first of them. i must be 0 or follow the last request
+ *     decoded before.
+ */
+traceop_t *trace_fill(trace_t *trace, int i)
+{
+  const char *p;
+  int n;
+
+  if (i == 0) {
+    trace->next = trace->data;
+    trace->prev = 0;
+  } else if (i != trace->first + trace->nops || trace->base == NULL) {
+    printf("%s: requests replayed out of order\n", trace->path);
+    exit(1);
+  }
+
+  n = trace->num_ops - i;
+  n = (n < TRACE_CHUNK) ? n : TRACE_CHUNK;
+  if (trace->binary)
+    trace_decode_bin(trace, n);
+  else
+    trace_decode_text(trace, n);
+  trace->first = i;
+  trace->nops = n;
+
+  /* Check that nothing follows the last request */
+  if (i + n == trace->num_ops) {
+    for (p = trace->next; !trace->binary && p < trace->end; p++)
+      if (!IS_SPACE(*p))
+        break;
+    if (p < trace->end)
+      trace_error(trace, p, "more requests than the header says");
+  }
+  return trace->ops;
+}
+
+/*
+ * read_trace - read a trace file and store it in memory
+ */
+trace_t *read_trace(char *tracedir, char *filename)
+{
+  trace_t *trace;
+  const char *p, *line;
+  struct stat st;
+  size_t len;
+  unsigned hdr[HDRWORDS];
+  int fd, i, n;
+
+  /* Allocate the trace record */
+  if ((trace = (trace_t *)calloc(1, sizeof(trace_t))) == NULL)
+    trace_unix_error(filename, "Could not allocate");
+
+  /* Map the trace file */
+  len = strlen(tracedir) + strlen(filename) + 1;
+  if ((trace->path = malloc(len)) == NULL)
+    trace_unix_error(filename, "Could not allocate");
+  snprintf(trace->path, len, "%s%s", tracedir, filename);
+  if ((fd = open(trace->path, O_RDONLY)) < 0 || fstat(fd, &st) < 0)
+    trace_unix_error(trace->path, "Could not open");
+  if (st.st_size == 0) {
+    printf("%s: empty trace file\n", trace->path);
+    exit(1);
+  }
+  trace->len = st.st_size;
+  trace->base = mmap(NULL, trace->len, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (trace->base == MAP_FAILED)
+    trace_unix_error(trace->path, "Could not map");
+  madvise((void *)trace->base, trace->len, MADV_SEQUENTIAL);
+  close(fd);
+  trace->end = trace->base + trace->len;
+
+  /* Read and check the trace file header */
+  trace->binary = trace->len >= strlen(TRACE_MAGIC) &&
+    !memcmp(trace->base, TRACE_MAGIC, strlen(TRACE_MAGIC));
+  if (trace->binary) {
+    if (trace->len < TRACE_HDR_SIZE)
+      trace_error(trace, trace->end, "bad trace header");
+    for (i = 0; i < HDRWORDS; i++)
+      if ((hdr[i] = trace_get_u32(trace->base + 4 + 4*i)) > INT_MAX)
+        trace_error(trace, trace->base + 4 + 4*i, "bad trace header");
+    trace->data = trace->base + TRACE_HDR_SIZE;
+  } else {
+    for (p = trace->base, i = 0; i < HDRWORDS; i++)
+      if ((p = trace_uint(line = p, trace->end, &hdr[i])) == NULL)
+        trace_error(trace, line, "bad trace header");
+    trace->data = p;
+  }
+  trace->sugg_heapsize = hdr[0]; /* not used */
+  trace->num_ids = hdr[1];
+  trace->num_ops = hdr[2];
+  trace->weight = hdr[3];
+  if (trace->num_ids > TRACE_MAX_IDS)
+    trace_error(trace, trace->data, "too many ids");
+  if (trace->num_ops > 0 && trace->num_ids == 0)
+    trace_error(trace, trace->data, "trace has requests but no ids");
+
+  /*
+   * We'll store the requests in the ops array, a chunk at a time, and
+   * keep an array of pointers to the allocated blocks along with the
+   * corresponding byte sizes of each block. All three share one chunk.
+   */
+  n = (trace->num_ops < TRACE_CHUNK) ? trace->num_ops : TRACE_CHUNK;
+  if ((trace->ops = (traceop_t *)malloc((size_t)n * sizeof(traceop_t) +
+          (size_t)trace->num_ids * (sizeof(char *) + sizeof(size_t))))
+      == NULL)
+    trace_unix_error(trace->path, "Could not allocate requests of");
+  trace->blocks = (char **)(trace->ops + n);
+  trace->block_sizes = (size_t *)(trace->blocks + trace->num_ids);
+
+  /* Decode the first chunk, and let go of the file if that was all */
+  trace_fill(trace, 0);
+  if (trace->nops == trace->num_ops) {
+    munmap((void *)trace->base, trace->len);
+    trace->base = NULL;
+  }
+  return trace;
+}
+
+/*
+ * free_trace - Free the trace record and the arrays it points to,
+ *              all of which were allocated in read_trace().
+ */
+void free_trace(trace_t *trace)
+{
+  if (trace->base)
+    munmap((void *)trace->base, trace->len);
+  free(trace->path);
+  free(trace->ops);         /* free the three arrays... */
+  free(trace);              /* and the trace record itself... */
+}
+
+/*
+ * trace_put_u32 - Write a little-endian word
+ */
+static void trace_put_u32(FILE *fp, unsigned v)
+{
+  putc(v & 0xff, fp);
+  putc(v >> 8 & 0xff, fp);
+  putc(v >> 16 & 0xff, fp);
+  putc(v >> 24, fp);
+}
+
+/*
+ * trace_put_varint - Write a varint
+ */
+static void trace_put_varint(FILE *fp, unsigned v)
+{
+  for (; v >= 0x80; v >>= 7)
+    putc((v & 0x7f) | 0x80, fp);
+  putc(v, fp);
+}
+
+/*
+ * trace_put_header - Write the header of a binary trace
+ */
+void trace_put_header(FILE *fp, int sugg_heapsize, int num_ids, int num_ops,
+    int weight)
+{
+  fputs(TRACE_MAGIC, fp);
+  trace_put_u32(fp, sugg_heapsize);
+  trace_put_u32(fp, num_ids);
+  trace_put_u32(fp, num_ops);
+  trace_put_u32(fp, weight);
+}
+
+/*
+ * trace_put_op - Write a request of a binary trace; *prev holds the
+ *     index of the previous one, and starts out 0
+ */
+void trace_put_op(FILE *fp, unsigned *prev, int type, unsigned index,
+    int size)
+{
+  int delta = (int)(index - *prev);
+  unsigned zz = ((unsigned)delta << 1) ^ (unsigned)(delta >> 31);
+
+  if (zz < TRACE_DELTA_ESC) {
+    putc(type << 4 | zz, fp);
+  } else {
+    putc(type << 4 | TRACE_DELTA_ESC, fp);
+    trace_put_varint(fp, zz);
+  }
+  if (type != FREE)
+    trace_put_varint(fp, size);
+  *prev = index;
+}
@@ -0,0 +1,78 @@
+/*
+ * trace.h - loading and writing of allocator trace files
+ *
+ * A trace is either a text .rep file or a binary trace. A binary trace
+ * starts with a TRACE_HDR_SIZE byte header: the four magic bytes
+ * TRACE_MAGIC, then sugg_heapsize, num_ids, num_ops and weight as
+ * little-endian 32-bit words. Each request follows as one op byte and
+ * up to two varints (7 bits per byte, low bits first):
+ *
+ *   op byte   type in the high nibble, and in the low nibble the
+ *             zigzag-coded difference between this request's index and
+ *             the previous one's, or TRACE_DELTA_ESC if that difference
+ *             follows as a varint
+ *   size      a varint, for ALLOC and REALLOC requests only
+ *
+ * Traces of up to TRACE_CHUNK requests are decoded when they are read.
+ * Longer ones stay mapped and are decoded TRACE_CHUNK requests at a time
+ * as they are replayed, so their requests never all sit in memory.
+ */
+#include <stdio.h>
+#include <stddef.h>
+
+#define TRACE_MAGIC     "MTR1"
+#define TRACE_HDR_SIZE  20
+#define TRACE_DELTA_ESC 0xf
+#define TRACE_MAX_IDS   (1 << 30)  /* index must fit traceop_t's bit field */
+#define TRACE_CHUNK     (1 << 16)  /* requests decoded at a time */
+
+/* Types of requests */
+enum {ALLOC, FREE, REALLOC};
+
+/* Characterizes a single trace operation (allocator request) */
+typedef struct {
+  unsigned type : 2;    /* type of request */
+  unsigned index : 30;  /* index for free() to use later */
+  int size;             /* byte size of alloc/realloc request */
+} traceop_t;
+
+/* Holds the information for one trace file*/
+typedef struct {
+  int sugg_heapsize;   /* suggested heap size (unused) */
+  int num_ids;         /* number of alloc/realloc ids */
+  int num_ops;         /* number of distinct requests */
+  int weight;          /* weight for this trace (unused) */
+  traceop_t *ops;      /* requests first..first+nops-1 */
+  int first;
+  int nops;
+  char **blocks;       /* array of ptrs returned by malloc/realloc... */
+  size_t *block_sizes; /* ... and a corresponding array of payload sizes */
+
+  /* the mapped file, while requests remain to be decoded from it */
+  char *path;
+  const char *base;    /* start of the mapping, NULL once unmapped */
+  const char *data;    /* first request */
+  const char *next;    /* next request to decode */
+  const char *end;
+  size_t len;
+  int binary;          /* binary rather than text trace? */
+  unsigned prev;       /* index of the last decoded request */
+} trace_t;
+
+/*
+ * TRACE_OP - the request at op i; a trace must be replayed in order,
+ * starting over from op 0
+ */
+#define TRACE_OP(trace, i) \
+  ((unsigned)((i) - (trace)->first) < (unsigned)(trace)->nops ? \
+   &(trace)->ops[(i) - (trace)->first] : trace_fill((trace), (i)))
+
+trace_t *read_trace(char *tracedir, char *filename);
+void free_trace(trace_t *trace);
+traceop_t *trace_fill(trace_t *trace, int i);
+
+/* Write the header of a binary trace, then each of its requests */
+void trace_put_header(FILE *fp, int sugg_heapsize, int num_ids, int num_ops,
+    int weight);
+void trace_put_op(FILE *fp, unsigned *prev, int type, unsigned index,
+    int size);